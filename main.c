@@ -1,5 +1,8 @@
 // This program is a Wayland client which draws arbitrary text to an EGL window.
 
+/* pipe2 */
+#define _GNU_SOURCE
+
 /* TODO:
  * - add xdg configure serial to display
  * - move over seat capabilities
@@ -17,10 +20,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <poll.h>
 #include <pty.h> 
+#include <time.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/input-event-codes.h>
 
 #include <stdint.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <EGL/egl.h>
 #include <GLES2/gl2.h>
@@ -40,19 +56,133 @@
 #include FT_OUTLINE_H
 #include FT_BBOX_H
 #include FT_TYPE1_TABLES_H
+#include FT_MODULE_H
+#include FT_DRIVER_H
+#ifdef HAVE_HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#include <hb-ot.h>
+#endif
 
 
 #define MAX(a, b) ((a) > (b) ? a : b)
+#define MIN(a, b) ((a) < (b) ? a : b)
 #define SHELL "/bin/bash"
 
+/* largest grid; the grid in use is sized to the window and the font */
 #define TERM_WIDTH 80
 #define TERM_HEIGHT 25
 
+#define FONT_PATH "/usr/share/fonts/TTF/Inconsolata-Regular.ttf"
+#define FONT_PIXEL_SIZE 24
+/* distance in atlas pixels covered by the signed distance field on each side
+ * of a glyph edge; kept small so the sdf atlas is no larger than the bitmap one */
+#define SDF_SPREAD 4
+/* color bitmap glyphs (cbdt/sbix emoji) come from here when it is installed */
+#define EMOJI_FONT_PATH "/usr/share/fonts/noto/NotoColorEmoji.ttf"
+/* faces tried in order for each codepoint, unless --font is given. the first
+ * one that loads draws the ascii atlas; missing ones are skipped */
+#define FONT_FALLBACKS { \
+	FONT_PATH, \
+	"/usr/share/fonts/TTF/DejaVuSansMono.ttf", \
+	"/usr/share/fonts/noto/NotoSansMono-Regular.ttf", \
+	"/usr/share/fonts/noto/NotoSansSymbols2-Regular.ttf", \
+	"/usr/share/fonts/noto-cjk/NotoSansCJK-Regular.ttc", \
+	EMOJI_FONT_PATH, \
+}
+#define FONT_MAX_FACES 16
+/* which face covers each codepoint, cached across runs under the user's
+ * cache directory and rebuilt when any face file changes */
+#define COVERAGE_FILE "gl_text-coverage"
+#define COVERAGE_MAGIC "gltcov1\n"
+#define ZOOM_STEP 1.1f
+#define ZOOM_MIN 0.5f
+#define ZOOM_MAX 4.0f
+
+/* scrollback is kept in fixed pages of lines; the oldest page is recycled */
+#define SCROLLBACK_PAGE_LINES 256
+#define SCROLLBACK_MAX_PAGES 64
+
+/* glyphs outside printable ascii go to square pages made on first use */
+#define GLYPH_PAGE_SIZE 512
+/* slots in the glyph cache hash table, a power of two */
+#define GLYPH_CACHE_SIZE 1024
+/* glyphs rasterized into the pages per frame; the rest wait for later frames */
+#define GLYPH_RASTER_PER_FRAME 64
+
+/* one vertex ring slot per visible line, plus one for a partially scrolled line.
+ * a slot holds a glyph per cell and room for combining marks on half of them */
+#define RING_ROWS (TERM_HEIGHT + 1)
+#define RING_SLOT_GLYPHS (TERM_WIDTH + TERM_WIDTH / 2)
+#define RING_SLOT_POINTS (6 * RING_SLOT_GLYPHS)
+
+/* zero width combining marks are kept with the cell before them, this many
+ * per cell; more are dropped. marks of lines in history are remembered in a
+ * ring of MARK_HISTORY, oldest overwritten first */
+#define CELL_MARKS 2
+#define MARK_HISTORY 4096
+
+/* longest we hold frames back for an application that began a synchronized
+ * update (DEC mode 2026) and never ended it */
+#define SYNC_TIMEOUT_MS 150
+
+/* most bytes taken from the pty per read; each read is one record when recording */
+#define READ_BUFFER_SIZE 4096
+#define RECORDING_MAGIC "gltrec1\n"
+/* longest a fast replay feeds the parser before letting frames through */
+#define REPLAY_SLICE_NS 4000000
+
+#define MAX_SESSIONS 64
+
+/* a snapshot of the counters is served to anyone connecting to this socket
+ * under $XDG_RUNTIME_DIR, with the pid appended; --metrics reads one */
+#define METRICS_SOCKET "gl_text-metrics"
+/* histogram buckets are powers of two; the last one takes everything above */
+#define METRICS_BUCKETS 32
+
+/* kitty graphics protocol: images per session, the bytes their textures may
+ * take before the least recently used go, and textures made per frame */
+#define IMAGE_MAX 64
+#define IMAGE_MAX_PLACEMENTS 256
+#define IMAGE_MAX_DIMENSION 4096
+#define IMAGE_CACHE_BYTES (64 << 20)
+#define IMAGE_UPLOADS_PER_FRAME 1
+#define GRAPHICS_CONTROL_MAX 256
+
+/* built with HAVE_HARFBUZZ, rows are shaped for ligatures and complex
+ * scripts; this many shaped rows are kept, looked up by their text */
+#define SHAPE_CACHE_SIZE 256
+/* glyph cache keys for glyphs the shaper chose, rather than codepoints */
+#define SHAPED_GLYPH (1u << 31)
+#define SHAPED_GLYPH_KEY(face, index) (SHAPED_GLYPH | (uint32_t)(face) << 16 | (index))
+
+/* hyperlinks: osc 8 targets in use at once per session and the longest kept, osc 8
+ * links remembered for lines in history, and links found per row. ctrl+click
+ * hands the target to LINK_OPENER */
+#define LINK_MAX_URIS 1024
+#define LINK_URI_MAX 2048
+#define LINK_HISTORY_SPANS 1024
+#define ROW_LINKS_MAX 8
+#define LINK_OPENER "xdg-open"
+
+/* --snapshot keeps the first session's state in a file it is restored from
+ * on the next start; written this often, on ctrl+shift+s and on close */
+#define SNAPSHOT_MAGIC "gltsnap\n"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_INTERVAL_MS 5000
+
+/* longest search query, and the time a scan of the history may take before
+ * the main loop goes back to polling the pty */
+#define SEARCH_QUERY_MAX 128
+#define SEARCH_SLICE_NS 2000000
+
 struct point {
 	GLfloat surface_x;
 	GLfloat surface_y;
 	GLfloat texture_x;
 	GLfloat texture_y;
+	/* enum glyph_page_kind of the texture the coordinates refer to */
+	GLfloat texture_page;
 };
 
 struct glyph {
@@ -68,11 +198,15 @@ struct glyph {
 };
 
 struct opengl_data {
-	GLuint vbo;
 	GLuint texture;
 	GLint attribute_coord;
+	GLint attribute_page;
 	GLint uniform_text;
+	GLint uniform_extra;
+	GLint uniform_emoji;
 	GLint uniform_color;
+	GLint uniform_transform;
+	GLint uniform_sdf;
 };
 
 struct freetype_data {
@@ -87,39 +221,381 @@ struct texture_data {
 	unsigned int max_char_height;
 	float texture_width;
 	float texture_height;
+	/* glyphs are stored as distance fields and can be drawn at any scale */
+	bool sdf;
+	/* pixels of distance field around every glyph bitmap, 0 without sdf */
+	unsigned int padding;
+	/* zoom applied to the atlas metrics when drawing */
+	float scale;
+	/* size the atlas was rasterized at */
+	int pixel_size;
+};
+
+/* a glyph atlas rasterized in memory, ready to be uploaded */
+struct atlas_image {
+	unsigned char *pixels;
+	struct glyph glyphs[128];
+	struct texture_data metrics;
+};
+
+/* rebuilds the bitmap atlas at a new size on a worker thread while the old
+ * one keeps rendering; the worker writes to notify_fd when it is done */
+struct atlas_builder {
+	pthread_t thread;
+	/* the primary face's file, opened again by the worker */
+	const char *font_path;
+	bool running;
+	/* false when no thread could be started and the build ran inline */
+	bool threaded;
+	int notify_fd[2];
+	int pixel_size;
+	/* size requested while a build was already running, 0 if none */
+	int pending_size;
+	/* a distance field atlas is only built once; zoom scales it */
+	bool sdf;
+	bool ok;
+	struct atlas_image image;
+};
+
+/* which texture a glyph is drawn from; the value is the vertex page attribute.
+ * GLYPH_PAGE_ATLAS is the ascii atlas, which cached glyphs use to mean that
+ * no font has the codepoint */
+enum glyph_page_kind {
+	GLYPH_PAGE_ATLAS,
+	GLYPH_PAGE_ALPHA,
+	GLYPH_PAGE_COLOR,
+	/* an inline image, bound in place of the color page; not premultiplied */
+	GLYPH_PAGE_IMAGE,
+};
+
+/* a texture filled shelf by shelf, left to right */
+struct glyph_page {
+	GLuint texture;
+	int shelf_x;
+	int shelf_y;
+	int shelf_height;
+};
+
+struct cached_glyph {
+	/* 0 marks a free slot; a SHAPED_GLYPH key names a face and glyph index */
+	uint32_t codepoint;
+	enum glyph_page_kind page;
+	/* bitmap sizes are in atlas pixels as drawn */
+	struct glyph glyph;
+	/* size on the page in texture coordinates */
+	float texture_width;
+	float texture_height;
+	/* the atlas pixel size it was rasterized for */
+	int pixel_size;
+};
+
+/* glyphs for codepoints past ascii, rasterized on the render thread when a
+ * ring slot first needs them. outlines go to an alpha page and color bitmaps
+ * to an rgba one; a pure ascii terminal never creates either */
+struct glyph_cache {
+	/* indexed by enum glyph_page_kind - 1 */
+	struct glyph_page pages[2];
+	struct cached_glyph entries[GLYPH_CACHE_SIZE];
+	int count;
+	/* a page or the table filled up; emptied before the next frame */
+	bool flush_pending;
+	/* glyphs rasterized so far this frame, and whether one was put off */
+	int rasterized;
+	bool deferred;
+};
+
+#ifdef HAVE_HARFBUZZ
+struct shaped_glyph {
+	/* a codepoint drawn as it would be unshaped, or a SHAPED_GLYPH key */
+	uint32_t key;
+	uint16_t cell;
+	/* from the shaper, in atlas pixels */
+	int16_t x_offset;
+	int16_t y_offset;
+};
+
+/* the glyphs of one row of text; glyph ids and offsets do not depend on the
+ * glyph cache, so they outlive its flushes */
+struct shaped_run {
+	uint64_t hash;
+	int pixel_size;
+	uint32_t cells[TERM_WIDTH];
+	uint32_t marks[TERM_WIDTH * CELL_MARKS];
+	int count;
+	struct shaped_glyph glyphs[RING_SLOT_GLYPHS];
+};
+
+/* a row as the shaper reads it: each cell's codepoint followed by its marks.
+ * cell is the cell each codepoint came from and at where each cell starts */
+struct shape_text {
+	uint32_t codepoints[TERM_WIDTH * (1 + CELL_MARKS)];
+	uint8_t cell[TERM_WIDTH * (1 + CELL_MARKS)];
+	int at[TERM_WIDTH + 1];
+	int len;
+};
+
+struct shaper {
+	/* created on first use, one per face in the chain, with the pixel size
+	 * each was last told about */
+	hb_font_t *fonts[FONT_MAX_FACES];
+	int font_sizes[FONT_MAX_FACES];
+	hb_buffer_t *buffer;
+	/* setup failed once; rows are drawn cell by cell from then on */
+	bool failed;
+	/* the primary face substitutes glyphs in plain ascii, as coding fonts
+	 * with ligatures do */
+	bool ascii_ligatures;
+	/* SHAPE_CACHE_SIZE runs, direct mapped by hash */
+	struct shaped_run *runs;
+};
+#endif
+
+struct font_face {
+	const char *path;
+	FT_Face face;
+	/* fixed size color bitmaps, drawn from the rgba page */
+	bool color;
+	/* the size face is set to; follows the atlas */
+	int pixel_size;
+	/* identify the file in the coverage cache */
+	int64_t file_size;
+	int64_t file_mtime;
+};
+
+/* codepoint -> face index, as 256 codepoint blocks. a block is either
+ * uniform, with COVERAGE_UNIFORM set and the face in the low byte, or the
+ * index of a leaf holding one face per codepoint */
+#define COVERAGE_CODEPOINTS 0x110000
+#define COVERAGE_BLOCKS (COVERAGE_CODEPOINTS / 256)
+#define COVERAGE_UNIFORM 0x8000
+#define COVERAGE_NONE 0xff
+struct coverage_index {
+	uint16_t blocks[COVERAGE_BLOCKS];
+	uint8_t (*leaves)[256];
+	uint32_t nleaves;
+};
+
+/* the fallback chain; faces[0] is the primary font */
+struct font_chain {
+	struct font_face faces[FONT_MAX_FACES];
+	int count;
+	struct coverage_index coverage;
+};
+
+struct scrollback_page {
+	uint32_t lines[SCROLLBACK_PAGE_LINES][TERM_WIDTH];
+};
+
+/* a run of cells on one line that is a link */
+struct link_span {
+	/* document line; only kept for spans in history */
+	uint64_t line;
+	uint16_t start;
+	/* one past the last cell */
+	uint16_t end;
+	/* interned osc 8 target, or 0 when the text itself is the url */
+	uint16_t uri;
+};
+
+/* a combining mark on a cell of a line in history */
+struct cell_mark {
+	uint64_t line;
+	uint16_t col;
+	uint32_t mark;
+};
+
+/* lines scrolled off the top of the primary screen. history line n lives in
+ * pages[(n / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES] */
+struct scrollback {
+	struct scrollback_page *pages[SCROLLBACK_MAX_PAGES];
+	/* search index: a bit for the low byte of every codepoint in each page */
+	uint64_t bytes_present[SCROLLBACK_MAX_PAGES][4];
+	uint64_t first_line;
+	uint64_t end_line;
+	/* pages restored from a snapshot point into this private mapping */
+	void *mapping;
+	size_t mapping_size;
+	/* osc 8 links of lines pushed into history, oldest overwritten first */
+	struct link_span link_spans[LINK_HISTORY_SPANS];
+	uint32_t link_spans_next;
+	uint32_t link_spans_count;
+	/* combining marks of lines pushed into history, in line order */
+	struct cell_mark marks[MARK_HISTORY];
+	uint32_t marks_next;
+	uint32_t marks_count;
+};
+
+/* a changed row stays dirty for the renderer and for search until each has
+ * rebuilt it and cleared its own bit */
+enum {
+	DIRTY_RING = 1,
+	DIRTY_SEARCH = 2,
+	DIRTY_ALL = DIRTY_RING | DIRTY_SEARCH,
+};
+
+/* one screen buffer; the primary and alternate screens each own a grid, cursor
+ * and saved cursor, so switching between them is a pointer swap */
+struct screen {
+	/* codepoints; 0 is an empty cell, as is the right half of a wide one */
+	uint32_t terminal_cells[TERM_HEIGHT][TERM_WIDTH];
+	/* DIRTY_* bits of rows written since each reader last looked */
+	uint8_t dirty[TERM_HEIGHT];
+	/* interned osc 8 link of each cell, 0 for none. links_used stays false
+	 * until a link is written, which spares scrolling from looking at them */
+	uint16_t links[TERM_HEIGHT][TERM_WIDTH];
+	bool links_used;
+	/* combining marks of each cell, cell i's at [i * CELL_MARKS], 0 for none.
+	 * like links, left alone until a mark is written */
+	uint32_t marks[TERM_HEIGHT][TERM_WIDTH * CELL_MARKS];
+	bool marks_used;
+	/* size of the grid in use, at most TERM_WIDTH x TERM_HEIGHT */
+	int cols;
+	int rows;
+	/* number of lines that have scrolled off the top; row 0 is document line base_line */
+	uint64_t base_line;
+	/* NULL for the alternate screen, which never writes into history */
+	struct scrollback *scrollback;
+	int term_x;
+	int term_y;
+	int saved_x;
+	int saved_y;
+};
+
+enum parser_state {
+	PARSER_GROUND,
+	PARSER_ESCAPE,
+	PARSER_CSI,
+	/* application program command, ESC _ ... ESC \ */
+	PARSER_APC,
+	PARSER_APC_ESCAPE,
+	/* operating system command, ESC ] ... BEL or ESC \ */
+	PARSER_OSC,
+	PARSER_OSC_ESCAPE,
+};
+
+#define PARSER_MAX_PARAMS 16
+
+struct parser {
+	enum parser_state state;
+	bool private_marker;
+	char intermediate;
+	int params[PARSER_MAX_PARAMS];
+	int nparams;
+	/* utf-8 sequence in progress */
+	uint32_t utf8_codepoint;
+	int utf8_remaining;
+	/* apc control data, up to the ';' that starts its payload */
+	char apc[GRAPHICS_CONTROL_MAX];
+	int apc_len;
+	bool apc_payload;
+	/* base64 payload bits not yet making up a byte */
+	uint32_t base64_bits;
+	int base64_count;
+	char osc[LINK_URI_MAX + 16];
+	int osc_len;
+	/* the osc 8 link text is being written under, 0 for none */
+	uint16_t link;
+};
+
+struct row_links {
+	int count;
+	struct link_span spans[ROW_LINKS_MAX];
 };
 
 struct render_data {
 	struct display *display;
+	struct session *session;
 	struct texture_data *texture_data;
 	struct glyph (*glyphs)[128];
 	struct opengl_data *gl_data;
-	char (*terminal_cells)[TERM_HEIGHT][TERM_WIDTH];
-	int term_x;
-	int term_y;
+	struct screen *screen;
+	struct screen *primary;
+	struct screen *alternate;
+	struct parser parser;
+	/* holds this session's vertex ring */
+	GLuint vbo;
+	/* document line whose vertices sit in each slot of the vbo, -1 if none */
+	int64_t ring_line[RING_ROWS];
+	/* links in each slot's line, found when the slot is built */
+	struct row_links ring_links[RING_ROWS];
+	/* how far the user scrolled back, in lines above the live screen */
+	int scroll_lines;
+	/* top of the drawn viewport in document pixels; chases scroll_lines */
+	int64_t view_px;
+	/* DEC mode 2026: the grid keeps absorbing output but no frame is drawn
+	 * until the application ends the update or SYNC_TIMEOUT_MS passes */
+	bool synchronized;
+	uint64_t sync_start_ns;
+	/* a frame callback arrived during a synchronized update */
+	bool frame_deferred;
+	struct wl_callback *frame_callback;
+	/* raw pty output is appended here when recording, NULL otherwise */
+	struct recording *recording;
+	uint64_t frames_rendered;
+	uint64_t frame_ns_total;
+	uint64_t frame_ns_max;
 };
 
 
+/* a recording is RECORDING_MAGIC followed by one record per pty read:
+ * the microseconds since the previous read and the byte count, both as
+ * LEB128 varints, then the bytes themselves */
+struct recording {
+	FILE *file;
+	uint64_t last_ns;
+};
+
+struct replay {
+	unsigned char *data;
+	size_t size;
+	size_t pos;
+	/* sleep between reads as long as the shell originally took */
+	bool realtime;
+	uint64_t start_ns;
+	/* when the next record is due in realtime mode, since start_ns */
+	uint64_t due_ns;
+	bool done;
+	size_t bytes;
+	size_t reads;
+	uint64_t parse_ns;
+};
+
+/* state shared by every terminal window in the process */
 struct display {
 	struct wl_display *wl_display;
 	struct wl_compositor *compositor;
 	struct xdg_wm_base *xdg_wm_base;
-	struct wl_surface *wl_surface;
-	struct xdg_surface *xdg_surface;
-	struct xdg_toplevel *xdg_toplevel;
-	struct wl_egl_window *egl_window;
 	EGLDisplay egl_display;
 	EGLContext egl_context;
-	EGLSurface egl_surface;
+	EGLConfig egl_config;
 	struct xkb_context *context;
 	struct wl_list seats;
-	struct pty *pty;
+	/* shader program locations and the glyph atlas, used by all sessions */
+	struct opengl_data *gl_data;
+	struct texture_data *texture_data;
+	struct glyph (*glyphs)[128];
+	struct font_chain fonts;
+	struct glyph_cache glyph_cache;
+	struct atlas_builder atlas_builder;
+	/* font zoom the user asked for, relative to FONT_PIXEL_SIZE */
+	float zoom;
+	struct wl_list sessions;
+	struct session *keyboard_focus;
+	/* ctrl+shift+n was pressed; the main loop opens the window */
+	bool new_session_pending;
+#ifdef HAVE_HARFBUZZ
+	struct shaper shaper;
+#endif
+	struct session *pointer_focus;
+	wl_fixed_t pointer_x;
+	wl_fixed_t pointer_y;
 };
 
 struct seat {
 	struct display *display;
 	struct wl_seat *wl_seat;
 	struct wl_keyboard *wl_kbd;
+	struct wl_pointer *wl_pointer;
     uint32_t version; /* ... of wl_seat */
     uint32_t global_name; /* an ID of sorts */
     char *name_str; /* a descriptor */
@@ -132,25 +608,237 @@ struct pty {
 	int master_fd, slave_fd;
 };
 
+struct search_match {
+	uint64_t line;
+	int col;
+};
+
+/* matches sorted by position; items before first were recycled away */
+struct match_list {
+	struct search_match *items;
+	size_t first;
+	size_t count;
+	size_t capacity;
+};
+
+/* the columns of the matches in one screen row, at most one per cell */
+struct search_row {
+	bool valid;
+	uint64_t line;
+	int count;
+	uint8_t cols[TERM_WIDTH];
+};
+
+/* incremental search over the primary screen and its scrollback. history
+ * lines never change, so their matches are found once, in time slices, and
+ * kept; screen rows are searched again only after they change */
+struct search {
+	bool active;
+	bool regex;
+	char query[SEARCH_QUERY_MAX];
+	int query_len;
+	/* the query as cells, for the substring kernel */
+	uint32_t needle[SEARCH_QUERY_MAX];
+	regex_t compiled;
+	bool compiled_ok;
+	struct match_list history;
+	struct match_list screen;
+	/* matches of each screen row by line % TERM_HEIGHT, rescanned only
+	 * when the row is dirty for search or holds a new line */
+	struct search_row rows[TERM_HEIGHT];
+	struct match_list row_matches;
+	/* the screen lines the screen list was last built from */
+	uint64_t screen_base;
+	int screen_rows;
+	/* next scrollback line to scan */
+	uint64_t scanned_line;
+	/* selected match, if any */
+	bool has_current;
+	struct search_match current;
+	size_t shown_total;
+};
+
+/* the snapshot file starts with this header, padded to SNAPSHOT_PAGES_OFFSET;
+ * scrollback page n follows in slot n % SCROLLBACK_MAX_PAGES, so the file
+ * mirrors the in-memory ring and restore can map pages in place */
+struct snapshot_screen {
+	int32_t cols;
+	int32_t rows;
+	int32_t term_x;
+	int32_t term_y;
+	int32_t saved_x;
+	int32_t saved_y;
+	uint64_t base_line;
+	uint32_t cells[TERM_HEIGHT][TERM_WIDTH];
+};
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	/* the layout the file was written with; any difference rejects it */
+	uint32_t term_width;
+	uint32_t term_height;
+	uint32_t page_lines;
+	uint32_t max_pages;
+	uint32_t alternate_active;
+	/* history lines on disk; kept together, they are updated on their own
+	 * before pages are overwritten. narrowed is set by that update and
+	 * cleared by the full header write after it, so while it is set the
+	 * grids below may be ahead of end_line */
+	uint64_t narrowed;
+	uint64_t first_line;
+	uint64_t end_line;
+	uint64_t bytes_present[SCROLLBACK_MAX_PAGES][4];
+	struct snapshot_screen primary;
+	struct snapshot_screen alternate;
+};
+
+#define SNAPSHOT_PAGES_OFFSET ((sizeof(struct snapshot_header) + 4095) / 4096 * 4096)
+
+struct snapshot {
+	/* -1 when the session is not snapshotted */
+	int fd;
+	/* history lines below this are already on disk */
+	uint64_t written_line;
+	uint64_t last_ns;
+};
+
+/* the keys of one kitty graphics escape that we act on */
+struct graphics_command {
+	/* a: t transmit, T transmit and put, p put, d delete */
+	char action;
+	/* t: d direct, s shared memory, f file, t temporary file */
+	char medium;
+	/* f: 24 rgb or 32 rgba */
+	int format;
+	/* s, v: size in pixels */
+	int width;
+	int height;
+	/* i */
+	uint32_t id;
+	/* c, r: cells to draw into, 0 for the image's own size */
+	int cols;
+	int rows;
+	/* q: 1 hides OK replies, 2 hides errors as well */
+	int quiet;
+	/* m: more chunks of a direct transfer follow */
+	bool more;
+	/* d: what to delete */
+	char delete_what;
+	/* O, S: where the pixels are in a file or shared memory object */
+	size_t offset;
+	size_t size;
+};
+
+struct image {
+	/* 0 for a free slot */
+	uint32_t id;
+	int width;
+	int height;
+	int format;
+	/* pixels until the texture is made: mapped from shared memory or a file,
+	 * or decoded from the escape */
+	unsigned char *data;
+	size_t size;
+	size_t received;
+	void *mapping;
+	size_t mapping_size;
+	GLuint texture;
+	uint64_t last_used;
+};
+
+struct image_placement {
+	/* 0 for a free slot */
+	uint32_t image_id;
+	struct screen *screen;
+	uint64_t line;
+	int col;
+	/* cells covered, and the drawn size in cells */
+	int cols;
+	int rows;
+	float width_cells;
+	float height_cells;
+};
+
+/* osc 8 targets, each stored once and referred to by id; id n is uris[n - 1].
+ * ids no longer referred to are freed when the table fills up, leaving NULL */
+struct link_table {
+	char *uris[LINK_MAX_URIS];
+	/* ids handed out so far, freed or not */
+	int count;
+	/* open addressing on the uri hash, holding ids */
+	uint16_t index[LINK_MAX_URIS * 2];
+};
+
+struct graphics {
+	struct image images[IMAGE_MAX];
+	struct image_placement placements[IMAGE_MAX_PLACEMENTS];
+	/* texture bytes of all images, counted at 4 per pixel */
+	size_t bytes;
+	uint64_t sequence;
+	struct graphics_command command;
+	/* the image a direct transfer is filling, across m=1 chunks */
+	struct image *loading;
+	/* decoded payload naming a file or shared memory object */
+	char path[256];
+	size_t path_len;
+};
+
+/* one terminal window: its surface, shell and grid. everything else lives in
+ * struct display and is shared with the other sessions */
+struct session {
+	struct wl_list link;
+	struct display *display;
+	struct wl_surface *wl_surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_egl_window *egl_window;
+	EGLSurface egl_surface;
+	int width;
+	int height;
+	uint32_t configure_serial;
+	/* master_fd is -1 when there is no shell, as in a replay */
+	struct pty pty;
+	struct screen primary;
+	struct screen alternate;
+	struct scrollback scrollback;
+	struct render_data render_data;
+	struct search search;
+	struct snapshot snapshot;
+	struct graphics graphics;
+	struct link_table links;
+	/* the window was closed or the shell exited; destroyed by the main loop */
+	bool closed;
+};
+
 struct egl {
-	EGLint *major, *minor;
-	EGLint *n;
+	EGLint major, minor;
+	EGLint n;
 	EGLConfig egl_config;
-	EGLint *config_attribs;
-	EGLint *context_attribs;
+	const EGLint *config_attribs;
+	const EGLint *context_attribs;
 };
 
 const GLfloat black[4] = {0, 0, 0, 1};
 
+/* coord.xy is in window pixels from the top left corner; transform.xy maps
+ * pixels to clip space and transform.zw is the scroll offset in pixels.
+ * page picks the texture: the ascii atlas, the alpha page or the rgba page,
+ * whose texels are premultiplied and drawn as they are */
 static const GLchar vertext_shader_src[] =
 	"#version 100\n"
 	"\n"
 	"attribute vec4 coord;\n"
+	"attribute float page;\n"
+	"uniform vec4 transform;\n"
 	"varying vec2 textpos;\n"
+	"varying float textpage;\n"
 	"\n"
 	"void main(void) {\n"
-	"  gl_Position = vec4(coord.xy, 0, 1);\n"
+	"  vec2 pos = (coord.xy + transform.zw) * transform.xy;\n"
+	"  gl_Position = vec4(pos.x - 1.0, 1.0 - pos.y, 0, 1);\n"
 	"  textpos = coord.zw;\n"
+	"  textpage = page;\n"
 	"}\n";
 
 static const GLchar fragtext_shader_src[] =
@@ -158,31 +846,263 @@ static const GLchar fragtext_shader_src[] =
     "precision mediump float;\n"
     "\n"
     "varying vec2 textpos;\n"
+    "varying float textpage;\n"
     "uniform sampler2D text;\n"
+    "uniform sampler2D extra;\n"
+    "uniform sampler2D emoji;\n"
     "uniform vec4 color;\n"
+    "uniform vec2 sdf;\n"
     "\n"
     "void main(void) {\n"
-    "  gl_FragColor = vec4(1, 1, 1, texture2D(text, textpos).a) * color;\n"
+    "  float alpha = textpage > 0.5 ? texture2D(extra, textpos).a : texture2D(text, textpos).a;\n"
+    "  if (sdf.x > 0.5)\n"
+    "    alpha = smoothstep(0.5 - sdf.y, 0.5 + sdf.y, alpha);\n"
+    "  vec4 texel = texture2D(emoji, textpos);\n"
+    "  if (textpage > 2.5)\n"
+    "    texel.rgb *= texel.a;\n"
+    "  gl_FragColor = textpage > 1.5 ? texel : vec4(1, 1, 1, alpha) * color;\n"
     "}\n";
 
 	
+/* size of a new window until the compositor configures it */
 static int width = 800;
 static int height = 800;
-static uint32_t xdg_configure_serial = 0;
 static bool running = true;
 static GLuint gl_text_prog = 0;
 static void render_cells(struct render_data *callback);
+static void draw_images(struct render_data *render_data, float sx, float sy);
+static void find_row_links(struct render_data *render_data, int64_t line, const uint32_t *cells,
+	int row, struct row_links *links);
+static void open_link_at(struct session *session, int x, int y);
+static void free_links(struct link_table *table);
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* bucket b counts values below 2^b that did not fit bucket b - 1 */
+struct histogram {
+	_Atomic uint64_t buckets[METRICS_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+};
+
+/* process wide and updated with relaxed atomics from any thread, so they
+ * stay on all the time; gauges are computed when a snapshot is served */
+static struct metrics {
+	_Atomic uint64_t pty_bytes;
+	_Atomic uint64_t pty_reads;
+	struct histogram parse_ns;
+	_Atomic uint64_t frames_rendered;
+	_Atomic uint64_t frames_skipped;
+	struct histogram frame_ns;
+	_Atomic uint64_t vertices_uploaded;
+	struct histogram vertex_bytes_per_frame;
+	_Atomic uint64_t texture_bytes_uploaded;
+	struct histogram atlas_build_ns;
+	_Atomic uint64_t wakeups;
+	_Atomic uint64_t rows_shaped;
+	_Atomic uint64_t shape_cache_hits;
+} metrics;
+
+static void count_metric(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static void record_histogram(struct histogram *histogram, uint64_t value) {
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+	if(bucket >= METRICS_BUCKETS)
+		bucket = METRICS_BUCKETS - 1;
+	atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+/* BEGIN STARTUP CODE */
+
+/* startup phases in the order main reaches them; each is stamped once, in
+ * ns since main began, and the lot is printed when the shell first writes */
+enum startup_phase {
+	STARTUP_SHELL,
+	STARTUP_FONTS,
+	STARTUP_GLOBALS,
+	STARTUP_EGL,
+	STARTUP_SURFACE,
+	STARTUP_SHADER,
+	STARTUP_ATLAS,
+	STARTUP_FIRST_FRAME,
+	STARTUP_FIRST_PROMPT,
+	STARTUP_PHASES,
+};
+
+static const char *startup_phase_names[STARTUP_PHASES] = {
+	"shell", "fonts", "globals", "egl", "surface", "shader", "atlas",
+	"first frame", "first prompt",
+};
+
+static struct startup {
+	uint64_t start_ns;
+	uint64_t phase_ns[STARTUP_PHASES];
+	bool reported;
+} startup;
+
+static void startup_mark(enum startup_phase phase) {
+	if(startup.phase_ns[phase] == 0)
+		startup.phase_ns[phase] = monotonic_ns() - startup.start_ns;
+}
+
+static void startup_report(void) {
+	uint64_t previous = 0;
+	int i;
+	startup.reported = true;
+	for(i = 0; i < STARTUP_PHASES; i++) {
+		if(startup.phase_ns[i] == 0)
+			continue;
+		fprintf(stderr, "startup: %-12s %7.2f ms (+%.2f)\n", startup_phase_names[i],
+			startup.phase_ns[i] / 1e6, (startup.phase_ns[i] - previous) / 1e6);
+		previous = startup.phase_ns[i];
+	}
+}
+
+/* END STARTUP CODE */
+
+static void mark_screen_dirty(struct screen *screen) {
+	memset(screen->dirty, DIRTY_ALL, sizeof screen->dirty);
+}
+
+static int cell_width(struct texture_data *texture_data) {
+	return texture_data->max_char_width * texture_data->scale + 0.5f;
+}
+
+static int cell_height(struct texture_data *texture_data) {
+	return texture_data->max_char_height * texture_data->scale + 0.5f;
+}
+
+/* glyphs hang from a baseline 50 atlas pixels down their slot (see
+ * build_ring_slot) and about four fifths of a cell is above it, so a row's
+ * cells start this many pixels into its slot */
+static int row_top(struct texture_data *texture_data) {
+	return 50 * texture_data->scale - cell_height(texture_data) * 4 / 5;
+}
+
+static void invalidate_ring(struct render_data *render_data) {
+	int i;
+	for(i = 0; i < RING_ROWS; i++)
+		render_data->ring_line[i] = -1;
+}
+
+static uint32_t *scrollback_line(struct scrollback *scrollback, uint64_t line) {
+	struct scrollback_page *page =
+		scrollback->pages[(line / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES];
+	return page->lines[line % SCROLLBACK_PAGE_LINES];
+}
+
+/* append a line to history, recycling the oldest page once all are in use */
+static void scrollback_push(struct scrollback *scrollback, const uint32_t *cells) {
+	uint64_t line = scrollback->end_line;
+	if(line % SCROLLBACK_PAGE_LINES == 0) {
+		struct scrollback_page **page =
+			&scrollback->pages[(line / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES];
+		if(*page == NULL) {
+			*page = malloc(sizeof **page);
+			if(*page == NULL) {
+				fprintf(stderr,"failed to allocate scrollback page\n");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			scrollback->first_line += SCROLLBACK_PAGE_LINES;
+		}
+		memset(scrollback->bytes_present[(line / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES],
+			0, sizeof scrollback->bytes_present[0]);
+	}
+	uint64_t *present = scrollback->bytes_present[(line / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES];
+	int i;
+	for(i = 0; i < TERM_WIDTH; i++) {
+		unsigned char c = cells[i];
+		present[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+	memcpy(scrollback_line(scrollback, line), cells, TERM_WIDTH * sizeof *cells);
+	scrollback->end_line++;
+}
+
+/* lines of history the user can currently scroll back through */
+static int scrollback_available(struct render_data *render_data) {
+	struct screen *screen = render_data->screen;
+	if(screen->scrollback == NULL)
+		return 0;
+	return screen->scrollback->end_line - screen->scrollback->first_line;
+}
+
+static void scroll_viewport(struct render_data *render_data, int lines) {
+	int available = scrollback_available(render_data);
+	render_data->scroll_lines += lines;
+	if(render_data->scroll_lines > available)
+		render_data->scroll_lines = available;
+	if(render_data->scroll_lines < 0)
+		render_data->scroll_lines = 0;
+}
+
+static void start_atlas_build(struct display *display, int pixel_size);
+static void resize_grid(struct render_data *render_data);
+
+/* after the cell size changed: rebuild the ring and refit the grid */
+static void cell_size_changed(struct render_data *render_data) {
+	invalidate_ring(render_data);
+	resize_grid(render_data);
+	render_data->view_px = ((int64_t)render_data->screen->base_line - render_data->scroll_lines)
+		* cell_height(render_data->texture_data);
+}
+
+/* zooming an sdf atlas only changes the scale the vertices are built with;
+ * a bitmap atlas is rebuilt in the background at the new pixel size. the atlas
+ * is shared, so every session follows */
+static void zoom_font(struct display *display, float zoom) {
+	struct texture_data *texture_data = display->texture_data;
+	struct session *session;
+	if(zoom < ZOOM_MIN)
+		zoom = ZOOM_MIN;
+	if(zoom > ZOOM_MAX)
+		zoom = ZOOM_MAX;
+	display->zoom = zoom;
+	if(!texture_data->sdf) {
+		start_atlas_build(display, FONT_PIXEL_SIZE * zoom + 0.5f);
+		return;
+	}
+	texture_data->scale = zoom;
+	wl_list_for_each(session, &display->sessions, link)
+		cell_size_changed(&session->render_data);
+}
+
+struct session *session_create(struct display *display);
+void session_start(struct session *session, bool spawn_shell);
+static void search_toggle(struct session *session);
+static void search_edit(struct session *session, int c);
+static void search_toggle_regex(struct session *session);
+static void search_jump(struct session *session, bool older);
+static int write_snapshot(struct session *session);
+static void free_graphics(struct session *session);
+static bool is_wide(uint32_t codepoint);
 
 /* PTY CODE */
 
 
-bool setup_new_tty(struct pty *pty, struct display *display) {
+bool setup_new_tty(struct pty *pty) {
 	pid_t p;
-	/* indicate that our terminal has no positioning capability other than spaces */
-	/* and carriage return, and that it is incapable of procesing escape sequences */
+	/* the parser handles private modes (DECSET/DECRST, DECRQM), DECSC/DECRC,
+	 * OSC 8 and APC graphics, but no cursor addressing or erasing, so the
+	 * shell is still told the terminal can only move by spaces and carriage
+	 * return. a real TERM would let full screen programs such as vim, less or
+	 * htop draw with sequences we ignore; with TERM=dumb they do not start in
+	 * full screen mode, and only programs that send the private modes
+	 * unconditionally reach 1049 or 2026 */
     char *env[] = { "TERM=dumb", NULL };
 	if (openpty(&pty->master_fd,&pty->slave_fd,NULL,NULL,NULL) < 0)
 		fprintf(stderr,"openpty");
+	/* later shells and link openers must not hold this session's master,
+	 * or closing its window would never hang up its shell */
+	fcntl(pty->master_fd, F_SETFD, FD_CLOEXEC);
 	
 	switch (p = fork()) {
 	case -1:
@@ -195,7 +1115,7 @@ bool setup_new_tty(struct pty *pty, struct display *display) {
         if (ioctl(pty->slave_fd, TIOCSCTTY, NULL) < 0)
         {
 			fprintf(stderr,"ioctl(TIOCSCTTY)");
-            return false;
+            _exit(1);
         }
 
         dup2(pty->slave_fd, 0);
@@ -203,15 +1123,28 @@ bool setup_new_tty(struct pty *pty, struct display *display) {
         dup2(pty->slave_fd, 2);
         close(pty->slave_fd);
         execle(SHELL, "-" SHELL, (char *)NULL, env);
-		break;
+        /* never fall back into the terminal's own loop in the child */
+        fprintf(stderr,"failed to run %s: %s\n", SHELL, strerror(errno));
+        _exit(127);
 	default:
 		close(pty->slave_fd);
-		display->pty = pty;
 		break;
 	}
 	return true;
 }
 
+/* tell the shell how big the grid is */
+static void resize_pty(struct pty *pty, struct screen *screen, struct texture_data *texture_data) {
+	struct winsize ws = {
+		.ws_row = screen->rows,
+		.ws_col = screen->cols,
+		.ws_xpixel = screen->cols * cell_width(texture_data),
+		.ws_ypixel = screen->rows * cell_height(texture_data),
+	};
+	if(ioctl(pty->master_fd, TIOCSWINSZ, &ws) < 0)
+		fprintf(stderr,"ioctl(TIOCSWINSZ)");
+}
+
 /* END PTY CODE */
 
 /* BEGIN XKBCOMMON CODE */
@@ -335,9 +1268,20 @@ kbd_key(void *data, struct wl_keyboard *wl_kbd, uint32_t serial, uint32_t time,
 	uint32_t key, uint32_t state)
 {
     struct seat *seat = data;
-	struct pty *pty = seat->display->pty;
+	struct display *display = seat->display;
+	struct session *session = display->keyboard_focus;
+	if (session == NULL)
+		return;
+	struct pty *pty = session->pty.master_fd >= 0 ? &session->pty : NULL;
+	struct render_data *render_data = &session->render_data;
 	int pressed = xkb_state_key_get_one_sym(seat->state,key+8);
+	bool shift = xkb_state_mod_name_is_active(seat->state, XKB_MOD_NAME_SHIFT,
+		XKB_STATE_MODS_EFFECTIVE) > 0;
+	bool ctrl = xkb_state_mod_name_is_active(seat->state, XKB_MOD_NAME_CTRL,
+		XKB_STATE_MODS_EFFECTIVE) > 0;
 	uint32_t keycode = key + 8;
+	/* escape leaves the search instead of quitting */
+	bool searching = session->search.active;
 	const xkb_keysym_t *syms;
 	int nsyms = xkb_state_key_get_syms(seat->state,
 		keycode, &syms);
@@ -345,6 +1289,60 @@ kbd_key(void *data, struct wl_keyboard *wl_kbd, uint32_t serial, uint32_t time,
 	for (int i = 0; i < nsyms; i++) {
 		xkb_keysym_t sym = syms[i];
 		if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+			/* shift+page up/down navigate scrollback instead of reaching the shell */
+			if (shift && (sym == XKB_KEY_Prior || sym == XKB_KEY_Next)) {
+				scroll_viewport(render_data,
+					(sym == XKB_KEY_Prior ? 1 : -1) * render_data->screen->rows / 2);
+				continue;
+			}
+			/* ctrl +/-/0 zoom the font */
+			if (ctrl && (sym == XKB_KEY_plus || sym == XKB_KEY_equal)) {
+				zoom_font(display, display->zoom * ZOOM_STEP);
+				continue;
+			}
+			if (ctrl && sym == XKB_KEY_minus) {
+				zoom_font(display, display->zoom / ZOOM_STEP);
+				continue;
+			}
+			if (ctrl && sym == XKB_KEY_0) {
+				zoom_font(display, 1);
+				continue;
+			}
+			/* ctrl+shift+n opens another terminal in this process. creating
+			 * one does a roundtrip, so it waits until dispatch has returned */
+			if (ctrl && shift && (sym == XKB_KEY_n || sym == XKB_KEY_N)) {
+				display->new_session_pending = true;
+				continue;
+			}
+			/* ctrl+shift+f searches the scrollback; while open, typing edits the
+			 * query, return/shift+return jump to the older/newer match and
+			 * ctrl+r switches between plain text and regex */
+			if (ctrl && shift && (sym == XKB_KEY_f || sym == XKB_KEY_F)) {
+				search_toggle(session);
+				continue;
+			}
+			/* ctrl+shift+s snapshots the session now, if it has a file */
+			if (ctrl && shift && (sym == XKB_KEY_s || sym == XKB_KEY_S)) {
+				write_snapshot(session);
+				continue;
+			}
+			if (session->search.active) {
+				if (ctrl && (sym == XKB_KEY_r || sym == XKB_KEY_R))
+					search_toggle_regex(session);
+				else if (sym == XKB_KEY_Return)
+					search_jump(session, !shift);
+				else if (sym == XKB_KEY_BackSpace)
+					search_edit(session, '\b');
+				else if (sym == XKB_KEY_Escape)
+					search_toggle(session);
+				else if (sym >= 32 && sym <= 126)
+					search_edit(session, sym);
+				continue;
+			}
+			render_data->scroll_lines = 0;
+			/* a replay has no shell to type into */
+			if (pty == NULL)
+				continue;
 			switch (sym) {
 				char c;
 			case XKB_KEY_Return:
@@ -362,7 +1360,7 @@ kbd_key(void *data, struct wl_keyboard *wl_kbd, uint32_t serial, uint32_t time,
 		}
 	}
 
-    if (pressed == XKB_KEY_Escape)
+    if (pressed == XKB_KEY_Escape && !searching)
         running=false;
 
 		tools_print_keycode_state(seat->state, NULL, key + 8,
@@ -372,11 +1370,23 @@ kbd_key(void *data, struct wl_keyboard *wl_kbd, uint32_t serial, uint32_t time,
 
 static void
 kbd_enter(void *data, struct wl_keyboard *wl_kbd, uint32_t serial,
-          struct wl_surface *surf, struct wl_array *keys) {}
+          struct wl_surface *surf, struct wl_array *keys) {
+    struct seat *seat = data;
+    struct session *session;
+    wl_list_for_each(session, &seat->display->sessions, link) {
+        if (session->wl_surface == surf)
+            seat->display->keyboard_focus = session;
+    }
+}
 
 static void
 kbd_leave(void *data, struct wl_keyboard *wl_kbd, uint32_t serial,
-          struct wl_surface *surf) {}
+          struct wl_surface *surf) {
+    struct seat *seat = data;
+    struct session *focus = seat->display->keyboard_focus;
+    if (focus && focus->wl_surface == surf)
+        seat->display->keyboard_focus = NULL;
+}
 
 
 static void
@@ -401,9 +1411,102 @@ static const struct wl_keyboard_listener kbd_listener = {
     kbd_repeat_info
 };
 
+static void pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		struct wl_surface *surf, wl_fixed_t x, wl_fixed_t y) {
+	struct seat *seat = data;
+	struct session *session;
+	wl_list_for_each(session, &seat->display->sessions, link) {
+		if(session->wl_surface == surf)
+			seat->display->pointer_focus = session;
+	}
+	seat->display->pointer_x = x;
+	seat->display->pointer_y = y;
+}
+
+static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		struct wl_surface *surf) {
+	struct seat *seat = data;
+	struct session *focus = seat->display->pointer_focus;
+	if(focus && focus->wl_surface == surf)
+		seat->display->pointer_focus = NULL;
+}
+
+static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		wl_fixed_t x, wl_fixed_t y) {
+	struct seat *seat = data;
+	seat->display->pointer_x = x;
+	seat->display->pointer_y = y;
+}
+
+/* ctrl+click opens the link under the pointer */
+static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
+		uint32_t time, uint32_t button, uint32_t state) {
+	struct seat *seat = data;
+	struct display *display = seat->display;
+	if(button != BTN_LEFT || state != WL_POINTER_BUTTON_STATE_PRESSED
+			|| display->pointer_focus == NULL || seat->state == NULL)
+		return;
+	if(!xkb_state_mod_name_is_active(seat->state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_EFFECTIVE))
+		return;
+	open_link_at(display->pointer_focus, wl_fixed_to_int(display->pointer_x),
+		wl_fixed_to_int(display->pointer_y));
+}
+
+static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		uint32_t axis, wl_fixed_t value) {}
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {}
+static void pointer_axis_source(void *data, struct wl_pointer *wl_pointer, uint32_t source) {}
+static void pointer_axis_stop(void *data, struct wl_pointer *wl_pointer, uint32_t time,
+		uint32_t axis) {}
+static void pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer, uint32_t axis,
+		int32_t discrete) {}
+#ifdef WL_POINTER_AXIS_VALUE120_SINCE_VERSION
+static void pointer_axis_value120(void *data, struct wl_pointer *wl_pointer, uint32_t axis,
+		int32_t value120) {}
+#endif
+#ifdef WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION
+static void pointer_axis_relative_direction(void *data, struct wl_pointer *wl_pointer,
+		uint32_t axis, uint32_t direction) {}
+#endif
+
+/* the seat is bound at the compositor's version, so every event it may send
+ * needs a handler */
+static const struct wl_pointer_listener pointer_listener = {
+	.enter = pointer_enter,
+	.leave = pointer_leave,
+	.motion = pointer_motion,
+	.button = pointer_button,
+	.axis = pointer_axis,
+	.frame = pointer_frame,
+	.axis_source = pointer_axis_source,
+	.axis_stop = pointer_axis_stop,
+	.axis_discrete = pointer_axis_discrete,
+#ifdef WL_POINTER_AXIS_VALUE120_SINCE_VERSION
+	.axis_value120 = pointer_axis_value120,
+#endif
+#ifdef WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION
+	.axis_relative_direction = pointer_axis_relative_direction,
+#endif
+};
+
+static void release_pointer(struct seat *seat) {
+	if (seat->version >= WL_POINTER_RELEASE_SINCE_VERSION)
+		wl_pointer_release(seat->wl_pointer);
+	else
+		wl_pointer_destroy(seat->wl_pointer);
+	seat->wl_pointer = NULL;
+}
+
 static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t caps) {
     struct seat *seat = data;
 
+	if (!seat->wl_pointer && (caps & WL_SEAT_CAPABILITY_POINTER)) {
+		seat->wl_pointer = wl_seat_get_pointer(seat->wl_seat);
+		wl_pointer_add_listener(seat->wl_pointer, &pointer_listener, seat);
+	} else if (seat->wl_pointer && !(caps & WL_SEAT_CAPABILITY_POINTER)) {
+		release_pointer(seat);
+	}
+
     if (!seat->wl_kbd && (caps & WL_SEAT_CAPABILITY_KEYBOARD)) {
         seat->wl_kbd = wl_seat_get_keyboard(seat->wl_seat);
         wl_keyboard_add_listener(seat->wl_kbd, &kbd_listener, seat);
@@ -433,6 +1536,8 @@ seat_name(void *data, struct wl_seat *wl_seat, const char *name) {
 static void
 seat_destroy(struct seat *seat)
 {
+	if (seat->wl_pointer)
+		release_pointer(seat);
     if (seat->wl_kbd) {
         if (seat->version >= WL_SEAT_RELEASE_SINCE_VERSION)
             wl_keyboard_release(seat->wl_kbd);
@@ -473,6 +1578,13 @@ static void frame_handle_done(void *data, struct wl_callback *callback,
 		uint32_t time) {
 	wl_callback_destroy(callback);
 	struct render_data *cb_data = data;
+	cb_data->frame_callback = NULL;
+	/* hold the frame until the application finishes its update */
+	if (cb_data->synchronized) {
+		cb_data->frame_deferred = true;
+		count_metric(&metrics.frames_skipped, 1);
+		return;
+	}
 	render_cells(cb_data);
 }
 
@@ -482,7 +1594,8 @@ static const struct wl_callback_listener frame_listener = {
 
 static void xdg_surface_handle_configure(void *data,
 		struct xdg_surface *xdg_surface, uint32_t serial) {
-	xdg_configure_serial = serial;
+	struct session *session = data;
+	session->configure_serial = serial;
 }
 
 static const struct xdg_surface_listener xdg_surface_listener = {
@@ -492,17 +1605,19 @@ static const struct xdg_surface_listener xdg_surface_listener = {
 static void xdg_toplevel_handle_configure(void *data,
 		struct xdg_toplevel *toplevel, int32_t w, int32_t h,
 		struct wl_array *state) {
+	struct session *session = data;
 	if (w > 0) {
-		width = w;
+		session->width = w;
 	}
 	if (h > 0) {
-		height = h;
+		session->height = h;
 	}
 }
 
 static void xdg_toplevel_handle_close(void *data,
 		struct xdg_toplevel *xdg_toplevel) {
-	running = false;
+	struct session *session = data;
+	session->closed = true;
 }
 
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
@@ -592,349 +1707,3585 @@ static GLuint compile_text_program(void) {
 	return shader_program;
 }
 
-/* when we draw here, we should be using monospaced vertex coordinates */
-static void render_cells(struct render_data *callback) {
-	struct opengl_data *gl_data = callback->gl_data;
-	struct glyph *glyphs = *(callback->glyphs);
-	struct texture_data *texture_data = callback->texture_data;
-	struct display *display = callback->display;
-	
-	if (xdg_configure_serial != 0) {
-		wl_egl_window_resize(display->egl_window, width, height, 0, 0);
-		xdg_surface_ack_configure(display->xdg_surface, xdg_configure_serial);
-		xdg_configure_serial = 0;
-	}
-
-	if (!eglMakeCurrent(display->egl_display, display->egl_surface, display->egl_surface, display->egl_context)) {
-		fprintf(stderr, "eglMakeCurrent failed\n");
-		return;
-	}
-	glUseProgram(gl_text_prog);
-	glViewport(0, 0, width, height);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-	glClearColor(1, 1, 1, 1);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glUniform4fv(gl_data->uniform_color, 1, black);
-	glEnableVertexAttribArray(gl_data->attribute_coord);
-	glBindBuffer(GL_ARRAY_BUFFER,gl_data->vbo);
-	glVertexAttribPointer(gl_data->attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, 0);
-	EGLint window_height, window_width;
-	eglQuerySurface(display->egl_display,display->egl_surface,EGL_HEIGHT,&window_height);
-	eglQuerySurface(display->egl_display,display->egl_surface,EGL_WIDTH,&window_width);
-	float sx = 2.0/window_width;
-	float sy = 2.0/window_height;
+/* BEGIN FONT CODE */
 
-	/* from this point on, GL_TEXTURE_2D becomes an alias for texture */
-	glBindTexture(GL_TEXTURE_2D,gl_data->texture);
-	glUniform1i(gl_data->uniform_text, 0);
+/* the face covering codepoint, or COVERAGE_NONE; one or two loads */
+static int coverage_face(const struct coverage_index *index, uint32_t codepoint) {
+	uint16_t block;
+	if(codepoint >= COVERAGE_CODEPOINTS)
+		return COVERAGE_NONE;
+	block = index->blocks[codepoint >> 8];
+	if(block & COVERAGE_UNIFORM)
+		return block & 0xff;
+	return index->leaves[block][codepoint & 0xff];
+}
 
-	/* draw the grid */
+/* open every face that exists; the first becomes the primary font.
+ * returns the number loaded */
+static int load_font_chain(FT_Library library, struct font_chain *fonts,
+		const char **paths, int npaths) {
+	int i;
+	fonts->count = 0;
+	for(i = 0; i < npaths && fonts->count < FONT_MAX_FACES; i++) {
+		struct font_face *font = &fonts->faces[fonts->count];
+		struct stat st;
+		if(stat(paths[i], &st) != 0 || FT_New_Face(library, paths[i], 0, &font->face) != 0) {
+			fprintf(stderr,"font %s not available, skipping\n", paths[i]);
+			continue;
+		}
+		font->path = paths[i];
+		font->color = FT_HAS_COLOR(font->face) && FT_HAS_FIXED_SIZES(font->face);
+		if(font->color)
+			FT_Select_Size(font->face, 0);
+		font->pixel_size = 0;
+		font->file_size = st.st_size;
+		font->file_mtime = st.st_mtime;
+		fonts->count++;
+	}
+	return fonts->count;
+}
 
-	struct point coords[6 * 80 * 25];
-	int c = 0;
+/* scan every face's character map; earlier faces win */
+static int build_coverage(struct font_chain *fonts) {
+	struct coverage_index *index = &fonts->coverage;
+	uint8_t *map = malloc(COVERAGE_CODEPOINTS);
+	uint32_t block, nleaves = 0;
 	int i;
-	int j;
-	for(i = 0; i < 25; i++) {
-		for(j = 0; j < 80; j++) {
-			int current_cell = (int)(*(callback->terminal_cells))[i][j];
-			if(current_cell == 0) {
-				continue;
-			}
-			float x = -1 + j*texture_data->max_char_width*sx;
-			float y = 1 - i*texture_data->max_char_height*sy - 50*sy;
-			float x2 = x + glyphs[current_cell].bitmap_left * sx;
-			float y2 =-y -glyphs[current_cell].bitmap_top * sy;
-			float w2 = glyphs[current_cell].bitmap_width * sx;
-			float h2 = glyphs[current_cell].bitmap_height * sy;
-			float glyph_width = glyphs[current_cell].bitmap_width / texture_data->texture_width;
-			float glyph_height = glyphs[current_cell].bitmap_height / texture_data->texture_height;
-			coords[c++] = (struct point) {
-				x2, -y2, glyphs[current_cell].x_offset, glyphs[current_cell].y_offset		};
-			coords[c++] = (struct point) {
-				x2 + w2, -y2, glyphs[current_cell].x_offset + glyph_width, glyphs[current_cell].y_offset
-			};
-			coords[c++] = (struct point) {
-				x2, -y2 - h2, glyphs[current_cell].x_offset, glyphs[current_cell].y_offset + glyph_height
-			};
-			coords[c++] = (struct point) {
-				x2 + w2, -y2, glyphs[current_cell].x_offset + glyph_width, glyphs[current_cell].y_offset
-			};
-			coords[c++] = (struct point) {
-				x2, -y2 - h2, glyphs[current_cell].x_offset, glyphs[current_cell].y_offset + glyph_height
-			};
-			coords[c++] = (struct point) {
-				x2 + w2, -y2 - h2, glyphs[current_cell].x_offset + glyph_width, glyphs[current_cell].y_offset + glyph_height
-			};
+	if(map == NULL) {
+		fprintf(stderr,"failed to allocate coverage map\n");
+		return 1;
+	}
+	memset(map, COVERAGE_NONE, COVERAGE_CODEPOINTS);
+	for(i = fonts->count - 1; i >= 0; i--) {
+		FT_Face face = fonts->faces[i].face;
+		FT_UInt glyph_index;
+		FT_ULong codepoint = FT_Get_First_Char(face, &glyph_index);
+		while(glyph_index != 0) {
+			if(codepoint < COVERAGE_CODEPOINTS)
+				map[codepoint] = i;
+			codepoint = FT_Get_Next_Char(face, codepoint, &glyph_index);
+		}
+	}
+	for(block = 0; block < COVERAGE_BLOCKS; block++) {
+		const uint8_t *cells = map + block * 256;
+		if(memcmp(cells, cells + 1, 255) == 0) {
+			index->blocks[block] = COVERAGE_UNIFORM | cells[0];
+			continue;
+		}
+		index->blocks[block] = nleaves++;
+	}
+	index->leaves = malloc((size_t)MAX(nleaves, 1) * sizeof *index->leaves);
+	if(index->leaves == NULL) {
+		fprintf(stderr,"failed to allocate coverage leaves\n");
+		free(map);
+		return 1;
+	}
+	for(block = 0; block < COVERAGE_BLOCKS; block++) {
+		if(!(index->blocks[block] & COVERAGE_UNIFORM))
+			memcpy(index->leaves[index->blocks[block]], map + block * 256, 256);
+	}
+	index->nleaves = nleaves;
+	free(map);
+	return 0;
+}
+
+static bool coverage_path(char *path, size_t size) {
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if(cache && cache[0])
+		return snprintf(path, size, "%s/" COVERAGE_FILE, cache) < (int)size;
+	if(home && home[0])
+		return snprintf(path, size, "%s/.cache/" COVERAGE_FILE, home) < (int)size;
+	return false;
+}
+
+/* the cache starts with the magic and the face list it was built from:
+ * count, then path length, path, size and mtime of each face */
+static bool write_coverage_header(FILE *file, struct font_chain *fonts) {
+	uint32_t count = fonts->count;
+	int i;
+	fwrite(COVERAGE_MAGIC, 1, sizeof COVERAGE_MAGIC - 1, file);
+	fwrite(&count, sizeof count, 1, file);
+	for(i = 0; i < fonts->count; i++) {
+		uint32_t len = strlen(fonts->faces[i].path);
+		fwrite(&len, sizeof len, 1, file);
+		fwrite(fonts->faces[i].path, 1, len, file);
+		fwrite(&fonts->faces[i].file_size, sizeof fonts->faces[i].file_size, 1, file);
+		fwrite(&fonts->faces[i].file_mtime, sizeof fonts->faces[i].file_mtime, 1, file);
+	}
+	return !ferror(file);
+}
+
+/* true if path holds an index built from exactly these faces */
+static bool load_coverage(struct font_chain *fonts, const char *path) {
+	struct coverage_index *index = &fonts->coverage;
+	FILE *file = fopen(path, "rb");
+	char *expected = NULL, *found = NULL;
+	size_t header_size;
+	bool ok = false;
+	uint32_t block;
+	if(file == NULL)
+		return false;
+	/* compare the header byte for byte with the one we would write */
+	FILE *header = open_memstream(&expected, &header_size);
+	if(header == NULL)
+		goto out;
+	write_coverage_header(header, fonts);
+	fclose(header);
+	found = malloc(header_size);
+	if(found == NULL || fread(found, 1, header_size, file) != header_size
+			|| memcmp(found, expected, header_size) != 0)
+		goto out;
+	if(fread(index->blocks, sizeof index->blocks, 1, file) != 1
+			|| fread(&index->nleaves, sizeof index->nleaves, 1, file) != 1
+			|| index->nleaves > COVERAGE_BLOCKS)
+		goto out;
+	index->leaves = malloc((size_t)MAX(index->nleaves, 1) * sizeof *index->leaves);
+	if(index->leaves == NULL)
+		goto out;
+	if(fread(index->leaves, sizeof *index->leaves, index->nleaves, file) != index->nleaves) {
+		free(index->leaves);
+		index->leaves = NULL;
+		goto out;
+	}
+	ok = true;
+	for(block = 0; block < COVERAGE_BLOCKS; block++) {
+		if(!(index->blocks[block] & COVERAGE_UNIFORM) && index->blocks[block] >= index->nleaves)
+			ok = false;
+	}
+	if(!ok) {
+		free(index->leaves);
+		index->leaves = NULL;
+	}
+out:
+	free(expected);
+	free(found);
+	fclose(file);
+	return ok;
+}
+
+/* written to a temporary name first, so a reader never sees half a file */
+static void save_coverage(struct font_chain *fonts, const char *path) {
+	struct coverage_index *index = &fonts->coverage;
+	char tmp[4096];
+	FILE *file;
+	if(snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid()) >= (int)sizeof tmp)
+		return;
+	file = fopen(tmp, "wb");
+	if(file == NULL)
+		return;
+	write_coverage_header(file, fonts);
+	fwrite(index->blocks, sizeof index->blocks, 1, file);
+	fwrite(&index->nleaves, sizeof index->nleaves, 1, file);
+	fwrite(index->leaves, sizeof *index->leaves, index->nleaves, file);
+	bool failed = ferror(file);
+	if(fclose(file) != 0)
+		failed = true;
+	if(failed || rename(tmp, path) != 0) {
+		fprintf(stderr,"failed to write font coverage cache %s\n", path);
+		unlink(tmp);
+	}
+}
+
+/* load the coverage index from the cache, or scan the faces and save it */
+static int init_coverage(struct font_chain *fonts) {
+	char path[4096];
+	bool cached = coverage_path(path, sizeof path);
+	if(cached && load_coverage(fonts, path))
+		return 0;
+	if(build_coverage(fonts) != 0)
+		return 1;
+	if(cached)
+		save_coverage(fonts, path);
+	return 0;
+}
+
+/* END FONT CODE */
+
+/* BEGIN GLYPH CACHE CODE */
+
+static FT_Error load_glyph_bitmap(FT_Face face, bool sdf, int c);
+static FT_Error load_glyph_index_bitmap(FT_Face face, bool sdf, FT_UInt index);
+
+/* forget every cached glyph; the pages are reused from the top left */
+static void flush_glyph_cache(struct display *display) {
+	struct glyph_cache *cache = &display->glyph_cache;
+	struct session *session;
+	int i;
+	memset(cache->entries, 0, sizeof cache->entries);
+	cache->count = 0;
+	for(i = 0; i < 2; i++) {
+		cache->pages[i].shelf_x = 0;
+		cache->pages[i].shelf_y = 0;
+		cache->pages[i].shelf_height = 0;
+	}
+	cache->flush_pending = false;
+	wl_list_for_each(session, &display->sessions, link)
+		invalidate_ring(&session->render_data);
+}
+
+/* reserve w x h pixels of a page, creating its texture on first use */
+static bool glyph_page_alloc(struct glyph_page *page, enum glyph_page_kind kind,
+		int w, int h, int *x, int *y) {
+	if(page->texture == 0) {
+		GLenum format = kind == GLYPH_PAGE_COLOR ? GL_RGBA : GL_ALPHA;
+		size_t bytes = (size_t)GLYPH_PAGE_SIZE * GLYPH_PAGE_SIZE * (kind == GLYPH_PAGE_COLOR ? 4 : 1);
+		/* cleared, so linear filtering at glyph edges reads nothing stray */
+		unsigned char *blank = calloc(bytes, 1);
+		if(blank == NULL) {
+			fprintf(stderr,"failed to allocate glyph page\n");
+			return false;
+		}
+		glActiveTexture(GL_TEXTURE0 + kind);
+		glGenTextures(1, &page->texture);
+		glBindTexture(GL_TEXTURE_2D, page->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, GLYPH_PAGE_SIZE, GLYPH_PAGE_SIZE, 0,
+			format, GL_UNSIGNED_BYTE, blank);
+		glActiveTexture(GL_TEXTURE0);
+		free(blank);
+	}
+	if(page->shelf_x + w > GLYPH_PAGE_SIZE) {
+		page->shelf_y += page->shelf_height + 1;
+		page->shelf_x = 0;
+		page->shelf_height = 0;
+	}
+	if(w > GLYPH_PAGE_SIZE || page->shelf_y + h > GLYPH_PAGE_SIZE)
+		return false;
+	*x = page->shelf_x;
+	*y = page->shelf_y;
+	page->shelf_x += w + 1;
+	page->shelf_height = MAX(page->shelf_height, h);
+	return true;
+}
+
+/* box filter a premultiplied bgra bitmap down to w x h rgba. color fonts
+ * ship a few large strikes, far bigger than a cell */
+static void downscale_bgra(const FT_Bitmap *bitmap, unsigned char *pixels, int w, int h) {
+	int x, y;
+	for(y = 0; y < h; y++) {
+		unsigned int y0 = y * bitmap->rows / h;
+		unsigned int y1 = MAX((y + 1) * bitmap->rows / h, y0 + 1);
+		for(x = 0; x < w; x++) {
+			unsigned int x0 = x * bitmap->width / w;
+			unsigned int x1 = MAX((x + 1) * bitmap->width / w, x0 + 1);
+			unsigned int sum[4] = {0, 0, 0, 0};
+			unsigned int sx, sy, n = (x1 - x0) * (y1 - y0);
+			for(sy = y0; sy < y1; sy++) {
+				const unsigned char *src = bitmap->buffer + sy * bitmap->pitch + x0 * 4;
+				for(sx = x0; sx < x1; sx++, src += 4) {
+					sum[0] += src[2];
+					sum[1] += src[1];
+					sum[2] += src[0];
+					sum[3] += src[3];
+				}
+			}
+			unsigned char *dst = pixels + ((size_t)y * w + x) * 4;
+			dst[0] = sum[0] / n;
+			dst[1] = sum[1] / n;
+			dst[2] = sum[2] / n;
+			dst[3] = sum[3] / n;
+		}
+	}
+}
+
+/* rasterize codepoint into a page. returns the page it went to, or
+ * GLYPH_PAGE_ATLAS if no font has it or there was no room */
+static enum glyph_page_kind rasterize_glyph(struct display *display, uint32_t codepoint,
+		struct cached_glyph *entry) {
+	struct glyph_cache *cache = &display->glyph_cache;
+	struct texture_data *texture_data = display->texture_data;
+	enum glyph_page_kind kind = GLYPH_PAGE_ALPHA;
+	bool shaped = codepoint & SHAPED_GLYPH;
+	int index = shaped ? (int)(codepoint >> 16 & 0x7fff)
+		: coverage_face(&display->fonts.coverage, codepoint);
+	struct font_face *font;
+	FT_GlyphSlot g;
+	FT_Error error;
+	int w, h, x, y;
+	float fit = 1;
+	if(index == COVERAGE_NONE || index >= display->fonts.count)
+		return GLYPH_PAGE_ATLAS;
+	font = &display->fonts.faces[index];
+	if(!font->color) {
+		if(font->pixel_size != texture_data->pixel_size) {
+			FT_Set_Pixel_Sizes(font->face, 0, texture_data->pixel_size);
+			font->pixel_size = texture_data->pixel_size;
+		}
+		if(shaped)
+			error = load_glyph_index_bitmap(font->face, texture_data->sdf, codepoint & 0xffff);
+		else
+			error = load_glyph_bitmap(font->face, texture_data->sdf, codepoint);
+		if(error)
+			return GLYPH_PAGE_ATLAS;
+		g = font->face->glyph;
+		w = g->bitmap.width;
+		h = g->bitmap.rows;
+	} else {
+		if(FT_Load_Char(font->face, codepoint, FT_LOAD_COLOR)
+				|| font->face->glyph->bitmap.pixel_mode != FT_PIXEL_MODE_BGRA)
+			return GLYPH_PAGE_ATLAS;
+		g = font->face->glyph;
+		kind = GLYPH_PAGE_COLOR;
+		/* fit the strike into two cells */
+		fit = MAX(g->bitmap.rows / (float)texture_data->max_char_height,
+			g->bitmap.width / (2.0f * texture_data->max_char_width));
+		if(fit < 1)
+			fit = 1;
+		w = g->bitmap.width / fit + 0.5f;
+		h = g->bitmap.rows / fit + 0.5f;
+	}
+	if(w == 0 || h == 0)
+		return GLYPH_PAGE_ATLAS;
+	if(!glyph_page_alloc(&cache->pages[kind - 1], kind, w, h, &x, &y)) {
+		cache->flush_pending = true;
+		return GLYPH_PAGE_ATLAS;
+	}
+	glActiveTexture(GL_TEXTURE0 + kind);
+	glBindTexture(GL_TEXTURE_2D, cache->pages[kind - 1].texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if(kind == GLYPH_PAGE_COLOR) {
+		unsigned char *pixels = malloc((size_t)w * h * 4);
+		if(pixels == NULL) {
+			glActiveTexture(GL_TEXTURE0);
+			return GLYPH_PAGE_ATLAS;
+		}
+		downscale_bgra(&g->bitmap, pixels, w, h);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		count_metric(&metrics.texture_bytes_uploaded, (uint64_t)w * h * 4);
+		free(pixels);
+	} else {
+		int row;
+		for(row = 0; row < h; row++)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + row, w, 1, GL_ALPHA, GL_UNSIGNED_BYTE,
+				g->bitmap.buffer + row * g->bitmap.pitch);
+		count_metric(&metrics.texture_bytes_uploaded, (uint64_t)w * h);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	entry->glyph = (struct glyph) {
+		x / (float)GLYPH_PAGE_SIZE,
+		y / (float)GLYPH_PAGE_SIZE,
+		(g->advance.x >> 6) / fit,
+		(g->advance.y >> 6) / fit,
+		w,
+		h,
+		g->bitmap_top / fit,
+		g->bitmap_left / fit
+	};
+	entry->texture_width = w / (float)GLYPH_PAGE_SIZE;
+	entry->texture_height = h / (float)GLYPH_PAGE_SIZE;
+	return kind;
+}
+
+/* the cache entry for a codepoint past ascii or a shaped glyph, rasterizing
+ * it on first use. at most GLYPH_RASTER_PER_FRAME glyphs are rasterized per
+ * frame, so a new atlas size or a screen of new text never stalls one frame:
+ * past that, a glyph from the previous atlas size is drawn as it was and a
+ * new one is left out, and deferred tells the caller to try again next frame.
+ * NULL also when the table is full, which schedules a flush */
+static const struct cached_glyph *lookup_glyph(struct display *display, uint32_t codepoint) {
+	struct glyph_cache *cache = &display->glyph_cache;
+	int pixel_size = display->texture_data->pixel_size;
+	unsigned int i = (codepoint * 2654435761u) & (GLYPH_CACHE_SIZE - 1);
+	struct cached_glyph *entry;
+	while(cache->entries[i].codepoint != 0) {
+		entry = &cache->entries[i];
+		if(entry->codepoint != codepoint) {
+			i = (i + 1) & (GLYPH_CACHE_SIZE - 1);
+			continue;
+		}
+		if(entry->pixel_size == pixel_size)
+			return entry;
+		if(cache->rasterized >= GLYPH_RASTER_PER_FRAME) {
+			cache->deferred = true;
+			return entry;
+		}
+		/* the old bitmap stays on its page until the next flush */
+		struct cached_glyph fresh = *entry;
+		cache->rasterized++;
+		fresh.page = rasterize_glyph(display, codepoint, &fresh);
+		if(fresh.page == GLYPH_PAGE_ATLAS && cache->flush_pending)
+			return entry;
+		fresh.pixel_size = pixel_size;
+		*entry = fresh;
+		return entry;
+	}
+	if(cache->count >= GLYPH_CACHE_SIZE * 3 / 4) {
+		cache->flush_pending = true;
+		return NULL;
+	}
+	if(cache->rasterized >= GLYPH_RASTER_PER_FRAME) {
+		cache->deferred = true;
+		return NULL;
+	}
+	entry = &cache->entries[i];
+	cache->rasterized++;
+	entry->page = rasterize_glyph(display, codepoint, entry);
+	/* a full page is retried after the flush rather than cached as missing */
+	if(entry->page == GLYPH_PAGE_ATLAS && cache->flush_pending)
+		return NULL;
+	entry->codepoint = codepoint;
+	entry->pixel_size = pixel_size;
+	cache->count++;
+	return entry;
+}
+
+/* END GLYPH CACHE CODE */
+
+/* BEGIN SHAPING CODE */
+#ifdef HAVE_HARFBUZZ
+
+/* a face has ligatures if its substitutions include any of these features */
+static bool face_has_ligatures(hb_face_t *face) {
+	hb_tag_t tags[64];
+	unsigned int offset = 0, count, i;
+	do {
+		count = sizeof tags / sizeof *tags;
+		hb_ot_layout_table_get_feature_tags(face, HB_OT_TAG_GSUB, offset, &count, tags);
+		for(i = 0; i < count; i++) {
+			if(tags[i] == HB_TAG('l','i','g','a') || tags[i] == HB_TAG('c','a','l','t')
+					|| tags[i] == HB_TAG('d','l','i','g'))
+				return true;
+		}
+		offset += count;
+	} while(count == sizeof tags / sizeof *tags);
+	return false;
+}
+
+static bool init_shaper(struct display *display) {
+	struct shaper *shaper = &display->shaper;
+	shaper->runs = calloc(SHAPE_CACHE_SIZE, sizeof *shaper->runs);
+	shaper->buffer = hb_buffer_create();
+	if(shaper->runs == NULL || !hb_buffer_allocation_successful(shaper->buffer)) {
+		fprintf(stderr,"failed to set up text shaping\n");
+		free(shaper->runs);
+		shaper->runs = NULL;
+		hb_buffer_destroy(shaper->buffer);
+		shaper->buffer = NULL;
+		shaper->failed = true;
+		return false;
+	}
+	hb_face_t *face = hb_ft_face_create_referenced(display->fonts.faces[0].face);
+	shaper->ascii_ligatures = face_has_ligatures(face);
+	hb_face_destroy(face);
+	return true;
+}
+
+/* ascii rows skip the shaper unless the font has ligatures and the row has
+ * two symbols in a row, which is what coding font ligatures are made of.
+ * combining marks are only placed right by the shaper */
+static bool needs_shaping(struct shaper *shaper, const uint32_t *cells, const uint32_t *marks) {
+	bool after_symbol = false;
+	int i;
+	if(marks)
+		return true;
+	for(i = 0; i < TERM_WIDTH; i++) {
+		uint32_t c = cells[i];
+		if(c >= 128)
+			return true;
+		bool symbol = c > ' ' && !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+			|| (c >= 'A' && c <= 'Z'));
+		if(symbol && after_symbol && shaper->ascii_ligatures)
+			return true;
+		after_symbol = symbol;
+	}
+	return false;
+}
+
+static void add_shaped_glyph(struct shaped_run *run, uint32_t key, int cell, int x, int y) {
+	if(run->count < RING_SLOT_GLYPHS)
+		run->glyphs[run->count++] = (struct shaped_glyph) { key, cell, x, y };
+}
+
+/* shape cells [start, end) and their marks, all covered by one outline face.
+ * the whole row is the context, so joining scripts join across face changes */
+static void shape_cells(struct display *display, struct shaped_run *run,
+		const struct shape_text *text, int start, int end, int index) {
+	struct shaper *shaper = &display->shaper;
+	struct font_face *font = &display->fonts.faces[index];
+	int pixel_size = display->texture_data->pixel_size;
+	unsigned int count, i, j, next;
+	if(shaper->fonts[index] == NULL)
+		shaper->fonts[index] = hb_ft_font_create_referenced(font->face);
+	if(font->pixel_size != pixel_size) {
+		FT_Set_Pixel_Sizes(font->face, 0, pixel_size);
+		font->pixel_size = pixel_size;
+	}
+	/* the hb font caches the face's scale; it only has to be told of a new size */
+	if(shaper->font_sizes[index] != pixel_size) {
+		hb_ft_font_changed(shaper->fonts[index]);
+		shaper->font_sizes[index] = pixel_size;
+	}
+	hb_buffer_clear_contents(shaper->buffer);
+	hb_buffer_add_codepoints(shaper->buffer, text->codepoints, text->len,
+		text->at[start], text->at[end] - text->at[start]);
+	hb_buffer_guess_segment_properties(shaper->buffer);
+	hb_shape(shaper->fonts[index], shaper->buffer, NULL, 0);
+	hb_glyph_info_t *info = hb_buffer_get_glyph_infos(shaper->buffer, &count);
+	hb_glyph_position_t *pos = hb_buffer_get_glyph_positions(shaper->buffer, &count);
+	bool backward = HB_DIRECTION_IS_BACKWARD(hb_buffer_get_direction(shaper->buffer));
+	/* glyphs come in visual order and each cluster is where its text starts;
+	 * it covers the cells up to the next cluster in text order. right to left
+	 * runs are mirrored within [start, end), so the first cell's text is
+	 * drawn rightmost. the glyphs of a cluster, such as a base and its marks,
+	 * are placed from the cluster's cell by their own advances */
+	for(i = 0; i < count; i = next) {
+		int cluster = info[i].cluster;
+		int cell = text->cell[cluster];
+		hb_position_t pen = 0;
+		for(next = i + 1; next < count && (int)info[next].cluster == cluster; next++)
+			;
+		/* the cluster after this one in text order is the one before it here */
+		if(backward)
+			cell = start + end - (i > 0 ? text->cell[info[i - 1].cluster] : end);
+		for(j = i; j < next; j++) {
+			uint32_t key = SHAPED_GLYPH_KEY(index, info[j].codepoint);
+			/* the glyph the cell gets anyway comes from the atlas or the
+			 * codepoint cache, so text the shaper left alone is not
+			 * rasterized twice */
+			if(next == i + 1 && pos[j].x_offset == 0 && pos[j].y_offset == 0
+					&& info[j].codepoint == FT_Get_Char_Index(font->face, text->codepoints[cluster]))
+				key = text->codepoints[cluster];
+			add_shaped_glyph(run, key, cell, (pen + pos[j].x_offset) / 64, pos[j].y_offset / 64);
+			pen += pos[j].x_advance;
+		}
+	}
+}
+
+/* the shaped glyphs for a row, NULL when it is drawn cell by cell. shaping
+ * only happens when a row's text is not in the table, so rows that did not
+ * change are never shaped again */
+static const struct shaped_run *shape_line(struct display *display, const uint32_t *cells,
+		const uint32_t *marks) {
+	struct shaper *shaper = &display->shaper;
+	struct font_chain *fonts = &display->fonts;
+	int pixel_size = display->texture_data->pixel_size;
+	uint64_t hash = 14695981039346656037ull;
+	struct shape_text text;
+	int i, k, start, end;
+	if(shaper->runs == NULL && (shaper->failed || !init_shaper(display)))
+		return NULL;
+	if(!needs_shaping(shaper, cells, marks))
+		return NULL;
+	static const uint32_t no_marks[TERM_WIDTH * CELL_MARKS];
+	if(marks == NULL)
+		marks = no_marks;
+	for(i = 0; i < TERM_WIDTH; i++)
+		hash = (hash ^ cells[i]) * 1099511628211ull;
+	for(i = 0; i < TERM_WIDTH * CELL_MARKS; i++)
+		hash = (hash ^ marks[i]) * 1099511628211ull;
+	struct shaped_run *run = &shaper->runs[hash & (SHAPE_CACHE_SIZE - 1)];
+	if(run->hash == hash && run->pixel_size == pixel_size
+			&& memcmp(run->cells, cells, sizeof run->cells) == 0
+			&& memcmp(run->marks, marks, sizeof run->marks) == 0) {
+		count_metric(&metrics.shape_cache_hits, 1);
+		return run;
+	}
+	run->hash = hash;
+	run->pixel_size = pixel_size;
+	memcpy(run->cells, cells, sizeof run->cells);
+	memcpy(run->marks, marks, sizeof run->marks);
+	run->count = 0;
+	text.len = 0;
+	for(i = 0; i < TERM_WIDTH; i++) {
+		text.at[i] = text.len;
+		text.cell[text.len] = i;
+		text.codepoints[text.len++] = cells[i];
+		for(k = 0; k < CELL_MARKS && marks[i * CELL_MARKS + k]; k++) {
+			text.cell[text.len] = i;
+			text.codepoints[text.len++] = marks[i * CELL_MARKS + k];
+		}
+	}
+	text.at[TERM_WIDTH] = text.len;
+	for(start = 0; start < TERM_WIDTH; start = end) {
+		end = start + 1;
+		if(cells[start] == 0)
+			continue;
+		int index = coverage_face(&fonts->coverage, cells[start]);
+		while(end < TERM_WIDTH && cells[end] != 0 && coverage_face(&fonts->coverage, cells[end]) == index)
+			end++;
+		if(index == COVERAGE_NONE || index >= fonts->count || fonts->faces[index].color) {
+			/* color bitmaps and missing glyphs are drawn cell by cell */
+			for(i = start; i < end; i++)
+				add_shaped_glyph(run, cells[i], i, 0, 0);
+		} else {
+			shape_cells(display, run, &text, start, end, index);
+		}
+	}
+	count_metric(&metrics.rows_shaped, 1);
+	return run;
+}
+
+#endif
+/* END SHAPING CODE */
+
+/* which text line of the document (scrollback followed by the active screen)
+ * is shown at absolute line number `line`; row is set to the screen row or -1 */
+static const uint32_t *document_line(struct render_data *render_data, int64_t line, int *row) {
+	struct screen *screen = render_data->screen;
+	*row = -1;
+	if(line >= (int64_t)screen->base_line) {
+		if(line - (int64_t)screen->base_line >= screen->rows)
+			return NULL;
+		*row = line - screen->base_line;
+		return screen->terminal_cells[*row];
+	}
+	if(screen->scrollback == NULL || line < (int64_t)screen->scrollback->first_line)
+		return NULL;
+	return scrollback_line(screen->scrollback, line);
+}
+
+/* the k-th mark in history, oldest first; like link spans, sorted by line */
+static struct cell_mark *history_mark(struct scrollback *scrollback, uint32_t k) {
+	return &scrollback->marks[(scrollback->marks_next + MARK_HISTORY
+		- scrollback->marks_count + k) % MARK_HISTORY];
+}
+
+/* keep the marks of a line leaving the screen */
+static void push_cell_marks(struct scrollback *scrollback, uint64_t line, const uint32_t *marks) {
+	int i;
+	for(i = 0; i < TERM_WIDTH * CELL_MARKS; i++) {
+		if(marks[i] == 0)
+			continue;
+		scrollback->marks[scrollback->marks_next] = (struct cell_mark) {
+			line, i / CELL_MARKS, marks[i]
+		};
+		scrollback->marks_next = (scrollback->marks_next + 1) % MARK_HISTORY;
+		if(scrollback->marks_count < MARK_HISTORY)
+			scrollback->marks_count++;
+	}
+}
+
+/* the marks of a document line as returned by document_line, NULL if it has
+ * none. a history line's are gathered into buf */
+static const uint32_t *document_marks(struct render_data *render_data, int64_t line, int row,
+		uint32_t *buf) {
+	struct screen *screen = render_data->screen;
+	struct scrollback *scrollback = screen->scrollback;
+	uint32_t lo = 0, hi, i;
+	bool any = false;
+	if(row >= 0)
+		return screen->marks_used ? screen->marks[row] : NULL;
+	if(scrollback == NULL)
+		return NULL;
+	hi = scrollback->marks_count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if((int64_t)history_mark(scrollback, mid)->line < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	memset(buf, 0, TERM_WIDTH * CELL_MARKS * sizeof *buf);
+	for(i = lo; i < scrollback->marks_count; i++) {
+		struct cell_mark *mark = history_mark(scrollback, i);
+		int k = 0;
+		if((int64_t)mark->line != line)
+			break;
+		/* a line's marks were pushed in cell order, so they fill in order */
+		while(k < CELL_MARKS && buf[mark->col * CELL_MARKS + k] != 0)
+			k++;
+		if(k < CELL_MARKS)
+			buf[mark->col * CELL_MARKS + k] = mark->mark;
+		any = true;
+	}
+	return any ? buf : NULL;
+}
+
+/* ascii comes from the atlas, everything else (codepoints and shaped glyph
+ * keys) from the glyph cache. NULL when there is nothing to draw */
+static const struct glyph *find_glyph(struct render_data *render_data, uint32_t key,
+		float *page, float *glyph_width, float *glyph_height) {
+	struct glyph *glyphs = *(render_data->glyphs);
+	struct texture_data *texture_data = render_data->texture_data;
+	if(key == 0)
+		return NULL;
+	if(key < 128) {
+		*page = GLYPH_PAGE_ATLAS;
+		*glyph_width = glyphs[key].bitmap_width / texture_data->texture_width;
+		*glyph_height = glyphs[key].bitmap_height / texture_data->texture_height;
+		return &glyphs[key];
+	}
+	const struct cached_glyph *cached = lookup_glyph(render_data->display, key);
+	if(cached == NULL || cached->page == GLYPH_PAGE_ATLAS)
+		return NULL;
+	*page = cached->page;
+	*glyph_width = cached->texture_width;
+	*glyph_height = cached->texture_height;
+	return &cached->glyph;
+}
+
+/* the six points of a glyph whose pen position is x, y in the ring */
+static void put_glyph_quad(struct point *coords, const struct glyph *glyph, float page,
+		float glyph_width, float glyph_height, float x, float y, float scale) {
+	float x2 = x + glyph->bitmap_left * scale;
+	float y2 = y + (50 - glyph->bitmap_top) * scale;
+	float w2 = glyph->bitmap_width * scale;
+	float h2 = glyph->bitmap_height * scale;
+	coords[0] = (struct point) {
+		x2, y2, glyph->x_offset, glyph->y_offset, page
+	};
+	coords[1] = (struct point) {
+		x2 + w2, y2, glyph->x_offset + glyph_width, glyph->y_offset, page
+	};
+	coords[2] = (struct point) {
+		x2, y2 + h2, glyph->x_offset, glyph->y_offset + glyph_height, page
+	};
+	coords[3] = (struct point) {
+		x2 + w2, y2, glyph->x_offset + glyph_width, glyph->y_offset, page
+	};
+	coords[4] = (struct point) {
+		x2, y2 + h2, glyph->x_offset, glyph->y_offset + glyph_height, page
+	};
+	coords[5] = (struct point) {
+		x2 + w2, y2 + h2, glyph->x_offset + glyph_width, glyph->y_offset + glyph_height, page
+	};
+}
+
+/* regenerate one slot of the vertex ring; positions are in pixels relative to
+ * the top of the ring so scrolling only ever changes the transform uniform */
+static void build_ring_slot(struct render_data *render_data, int slot, const uint32_t *line,
+		const uint32_t *marks) {
+	struct texture_data *texture_data = render_data->texture_data;
+	struct point coords[RING_SLOT_POINTS];
+	const struct glyph *glyph;
+	float page, glyph_width, glyph_height;
+	float scale = texture_data->scale;
+	float y = slot*cell_height(texture_data);
+	int c = 0;
+	int j, k;
+#ifdef HAVE_HARFBUZZ
+	const struct shaped_run *run = line ? shape_line(render_data->display, line, marks) : NULL;
+	if(run) {
+		for(j = 0; j < run->count; j++) {
+			const struct shaped_glyph *shaped = &run->glyphs[j];
+			glyph = find_glyph(render_data, shaped->key, &page, &glyph_width, &glyph_height);
+			if(glyph == NULL)
+				continue;
+			put_glyph_quad(&coords[c], glyph, page, glyph_width, glyph_height,
+				shaped->cell * cell_width(texture_data) + shaped->x_offset * scale,
+				y - shaped->y_offset * scale, scale);
+			c += 6;
+		}
+		/* the slot is always drawn whole; what is left stays degenerate */
+		memset(&coords[c], 0, (RING_SLOT_POINTS - c) * sizeof *coords);
+		glBufferSubData(GL_ARRAY_BUFFER, slot * sizeof coords, sizeof coords, coords);
+		return;
+	}
+#endif
+	for(j = 0; j < TERM_WIDTH; j++) {
+		glyph = find_glyph(render_data, line ? line[j] : 0, &page, &glyph_width, &glyph_height);
+		if(glyph == NULL) {
+			/* empty cells keep their place in the slot as degenerate quads */
+			memset(&coords[c], 0, 6 * sizeof *coords);
+		} else {
+			put_glyph_quad(&coords[c], glyph, page, glyph_width, glyph_height,
+				j*cell_width(texture_data), y, scale);
+		}
+		c += 6;
+	}
+	/* marks follow the cells. one without an advance is drawn back from the
+	 * end of its base, where fonts put the pen for it; others over the base */
+	for(j = 0; marks && j < TERM_WIDTH; j++) {
+		for(k = 0; k < CELL_MARKS && marks[j * CELL_MARKS + k] && c < RING_SLOT_POINTS; k++) {
+			glyph = find_glyph(render_data, marks[j * CELL_MARKS + k], &page, &glyph_width, &glyph_height);
+			if(glyph == NULL)
+				continue;
+			int x = glyph->x_advance == 0 ? j + (is_wide(line[j]) ? 2 : 1) : j;
+			put_glyph_quad(&coords[c], glyph, page, glyph_width, glyph_height,
+				x*cell_width(texture_data), y, scale);
+			c += 6;
+		}
+	}
+	memset(&coords[c], 0, (RING_SLOT_POINTS - c) * sizeof *coords);
+	glBufferSubData(GL_ARRAY_BUFFER, slot * sizeof coords, sizeof coords, coords);
+}
+
+/* move the drawn viewport towards the scrollback position the user asked for,
+ * a few pixels per frame; jumps longer than a screen are taken at once so
+ * heavy output never queues up an animation */
+static void update_view(struct render_data *render_data, int line_height) {
+	struct screen *screen = render_data->screen;
+	int64_t target = ((int64_t)screen->base_line - render_data->scroll_lines) * line_height;
+	int64_t distance = target - render_data->view_px;
+	if(distance > TERM_HEIGHT * line_height || -distance > TERM_HEIGHT * line_height) {
+		render_data->view_px = target;
+	} else if(distance != 0) {
+		int64_t step = distance / 3;
+		if(step == 0)
+			step = distance > 0 ? 1 : -1;
+		render_data->view_px += step;
+	}
+}
+
+/* when we draw here, we should be using monospaced vertex coordinates */
+static void render_cells(struct render_data *callback) {
+	struct opengl_data *gl_data = callback->gl_data;
+	struct texture_data *texture_data = callback->texture_data;
+	struct display *display = callback->display;
+	struct session *session = callback->session;
+	uint64_t frame_start = monotonic_ns();
+	
+	if (session->configure_serial != 0) {
+		wl_egl_window_resize(session->egl_window, session->width, session->height, 0, 0);
+		xdg_surface_ack_configure(session->xdg_surface, session->configure_serial);
+		session->configure_serial = 0;
+		resize_grid(callback);
+	}
+
+	/* all sessions draw with the one context, each into its own surface */
+	if (!eglMakeCurrent(display->egl_display, session->egl_surface, session->egl_surface, display->egl_context)) {
+		fprintf(stderr, "eglMakeCurrent failed\n");
+		return;
+	}
+	if (display->glyph_cache.flush_pending)
+		flush_glyph_cache(display);
+	display->glyph_cache.rasterized = 0;
+	glUseProgram(gl_text_prog);
+	glViewport(0, 0, session->width, session->height);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glClearColor(1, 1, 1, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glUniform4fv(gl_data->uniform_color, 1, black);
+	glEnableVertexAttribArray(gl_data->attribute_coord);
+	glEnableVertexAttribArray(gl_data->attribute_page);
+	glBindBuffer(GL_ARRAY_BUFFER,callback->vbo);
+	glVertexAttribPointer(gl_data->attribute_coord, 4, GL_FLOAT, GL_FALSE, sizeof(struct point), 0);
+	glVertexAttribPointer(gl_data->attribute_page, 1, GL_FLOAT, GL_FALSE, sizeof(struct point),
+		(void *)offsetof(struct point, texture_page));
+	EGLint window_height, window_width;
+	eglQuerySurface(display->egl_display,session->egl_surface,EGL_HEIGHT,&window_height);
+	eglQuerySurface(display->egl_display,session->egl_surface,EGL_WIDTH,&window_width);
+	float sx = 2.0/window_width;
+	float sy = 2.0/window_height;
+	struct screen *screen = callback->screen;
+	int line_height = cell_height(texture_data);
+
+	/* the glyph pages sit on the texture units matching their page number,
+	 * so glyphs from all three draw in the same batch */
+	glActiveTexture(GL_TEXTURE0 + GLYPH_PAGE_ALPHA);
+	glBindTexture(GL_TEXTURE_2D, display->glyph_cache.pages[GLYPH_PAGE_ALPHA - 1].texture);
+	glActiveTexture(GL_TEXTURE0 + GLYPH_PAGE_COLOR);
+	glBindTexture(GL_TEXTURE_2D, display->glyph_cache.pages[GLYPH_PAGE_COLOR - 1].texture);
+	glActiveTexture(GL_TEXTURE0);
+	/* from this point on, GL_TEXTURE_2D becomes an alias for texture */
+	glBindTexture(GL_TEXTURE_2D,gl_data->texture);
+	glUniform1i(gl_data->uniform_text, GLYPH_PAGE_ATLAS);
+	glUniform1i(gl_data->uniform_extra, GLYPH_PAGE_ALPHA);
+	glUniform1i(gl_data->uniform_emoji, GLYPH_PAGE_COLOR);
+
+	/* an sdf edge is smoothed over about one screen pixel whatever the zoom */
+	glUniform2f(gl_data->uniform_sdf, texture_data->sdf ? 1 : 0,
+		0.25f / (SDF_SPREAD * texture_data->scale));
+
+	update_view(callback, line_height);
+	int64_t top_line = callback->view_px / line_height;
+	int frac = callback->view_px - top_line * line_height;
+
+	/* only lines that are new to the ring, or rows the cell writer touched,
+	 * are rebuilt; everything else is still in the vbo from earlier frames */
+	int k;
+	int slots_built = 0;
+	for(k = 0; k < RING_ROWS; k++) {
+		int64_t line = top_line + k;
+		int slot = line % RING_ROWS;
+		int row;
+		const uint32_t *cells = document_line(callback, line, &row);
+		bool stale = callback->ring_line[slot] != line || (row >= 0 && (screen->dirty[row] & DIRTY_RING));
+		if(stale) {
+			uint32_t history_marks[TERM_WIDTH * CELL_MARKS];
+			display->glyph_cache.deferred = false;
+			build_ring_slot(callback, slot, cells,
+				cells ? document_marks(callback, line, row, history_marks) : NULL);
+			find_row_links(callback, line, cells, row, &callback->ring_links[slot]);
+			/* a slot missing glyphs that were put off is built again next frame */
+			callback->ring_line[slot] = display->glyph_cache.deferred ? -1 : line;
+			slots_built++;
 		}
+		if(row >= 0)
+			screen->dirty[row] &= ~DIRTY_RING;
+	}
+
+	/* the ring wraps at top_slot, so it is drawn as two runs of slots */
+	int top_slot = top_line % RING_ROWS;
+	glUniform4f(gl_data->uniform_transform, sx, sy, 0,
+		-(float)(top_slot * line_height + frac));
+	glDrawArrays(GL_TRIANGLES, top_slot * RING_SLOT_POINTS,
+		(RING_ROWS - top_slot) * RING_SLOT_POINTS);
+	if(top_slot > 0) {
+		glUniform4f(gl_data->uniform_transform, sx, sy, 0,
+			(float)((RING_ROWS - top_slot) * line_height - frac));
+		glDrawArrays(GL_TRIANGLES, 0, top_slot * RING_SLOT_POINTS);
 	}
-	glBufferData(GL_ARRAY_BUFFER,sizeof coords, coords, GL_DYNAMIC_DRAW);
-	glDrawArrays(GL_TRIANGLES, 0, c);
+	draw_images(callback, sx, sy);
+
 	glDisableVertexAttribArray(gl_data->attribute_coord);
+	glDisableVertexAttribArray(gl_data->attribute_page);
 	glUseProgram(0);
-	struct wl_callback *wl_callback = wl_surface_frame(display->wl_surface);
+	struct wl_callback *wl_callback = wl_surface_frame(session->wl_surface);
 	/* create a struct w/ texture map params and add it here */
 	wl_callback_add_listener(wl_callback, &frame_listener, callback);
-	if (!eglSwapBuffers(display->egl_display, display->egl_surface)) {
+	callback->frame_callback = wl_callback;
+	if (!eglSwapBuffers(display->egl_display, session->egl_surface)) {
 		fprintf(stderr, "eglSwapBuffers failed\n");
 	}
+	startup_mark(STARTUP_FIRST_FRAME);
+	uint64_t frame_ns = monotonic_ns() - frame_start;
+	callback->frames_rendered++;
+	count_metric(&metrics.frames_rendered, 1);
+	record_histogram(&metrics.frame_ns, frame_ns);
+	count_metric(&metrics.vertices_uploaded, (uint64_t)slots_built * RING_SLOT_POINTS);
+	record_histogram(&metrics.vertex_bytes_per_frame,
+		(uint64_t)slots_built * RING_SLOT_POINTS * sizeof(struct point));
+	callback->frame_ns_total += frame_ns;
+	if(frame_ns > callback->frame_ns_max)
+		callback->frame_ns_max = frame_ns;
+}
+
+/* render the face's glyph slot either as a coverage bitmap or, in sdf mode,
+ * as a distance field that stays sharp when scaled */
+static FT_Error load_glyph_index_bitmap(FT_Face face, bool sdf, FT_UInt index) {
+	if(!sdf)
+		return FT_Load_Glyph(face,index,FT_LOAD_RENDER);
+	FT_Error error = FT_Load_Glyph(face,index,FT_LOAD_DEFAULT);
+	if(error)
+		return error;
+	return FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF);
+}
+
+static FT_Error load_glyph_bitmap(FT_Face face, bool sdf, int c) {
+	return load_glyph_index_bitmap(face, sdf, FT_Get_Char_Index(face, c));
+}
+
+/* lay the printable ascii glyphs out in one row of an alpha image. touches no
+ * gl state, so it is safe to run away from the render thread.
+ * image->metrics.sdf and padding must be set by the caller */
+static int rasterize_atlas(FT_Face face, struct atlas_image *image) {
+	struct texture_data *metrics = &image->metrics;
+	FT_GlyphSlot g = face->glyph;
+	int i;
+	int offset_x = 0;
+	unsigned int max_rows = 0;
+	metrics->texture_width = 0;
+	metrics->max_char_width = 0;
+	metrics->max_char_height = 0;
+	memset(image->glyphs, 0, sizeof image->glyphs);
+	for(i=32; i < 128; i++) {
+		if(load_glyph_bitmap(face,metrics->sdf,i)) {
+			fprintf(stderr, "Loading character %c failed.\n",i);
+			continue;
+		}
+		metrics->texture_width += g->bitmap.width + 1;
+		max_rows = MAX(g->bitmap.rows,max_rows);
+		/* cell size comes from the glyph itself, not the distance field around it */
+		if(g->bitmap.width > 2 * metrics->padding)
+			metrics->max_char_width = MAX(g->bitmap.width - 2 * metrics->padding,metrics->max_char_width);
+		if(g->bitmap.rows > 2 * metrics->padding)
+			metrics->max_char_height = MAX(g->bitmap.rows - 2 * metrics->padding,metrics->max_char_height);
+	}
+	metrics->texture_height = max_rows;
+	image->pixels = calloc((size_t)metrics->texture_width * max_rows, 1);
+	if(image->pixels == NULL) {
+		fprintf(stderr,"failed to allocate glyph atlas\n");
+		return 1;
+	}
+	for(i=32; i < 128; i++) {
+		if(load_glyph_bitmap(face,metrics->sdf,i)) {
+			fprintf(stderr, "Loading character %c failed.\n",i);
+			continue;
+		}
+		unsigned int row;
+		for(row = 0; row < g->bitmap.rows; row++) {
+			memcpy(image->pixels + row * (size_t)metrics->texture_width + offset_x,
+				g->bitmap.buffer + row * g->bitmap.pitch, g->bitmap.width);
+		}
+		image->glyphs[i] = (struct glyph) {
+			offset_x / (float)metrics->texture_width,
+			0,
+			g->advance.x >> 6,
+			g->advance.y >> 6,
+			g->bitmap.width,
+			g->bitmap.rows,
+			g->bitmap_top,
+			g->bitmap_left
+		};
+		offset_x += g->bitmap.width + 1;
+	}
+	return 0;
+}
+
+/* replace the atlas texture with a rasterized image; the image is consumed */
+static void upload_atlas(struct opengl_data *gl_data, struct texture_data *texture_data, struct glyph *glyphs, struct atlas_image *image) {
+	GLuint old_texture = gl_data->texture;
+	glActiveTexture(GL_TEXTURE0);
+	/* store one texture name in texture param */
+	glGenTextures(1,&gl_data->texture);
+	/* create or use named texture */
+	/* from this point on, GL_TEXTURE_2D becomes an alias for texture */
+	glBindTexture(GL_TEXTURE_2D,gl_data->texture);
+	/* when pixels are read from client memory, require byte alignment */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	/*
+	 * Allow elements of image array to be read by shaders
+	 * Data is read from the image as sequence of unsigned bytes
+	 * and grouped into sets of one value to form elements
+	 * */
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, image->metrics.texture_width, image->metrics.texture_height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, image->pixels);
+	count_metric(&metrics.texture_bytes_uploaded,
+		(uint64_t)image->metrics.texture_width * image->metrics.texture_height);
+	if(old_texture != 0)
+		glDeleteTextures(1,&old_texture);
+	free(image->pixels);
+	image->pixels = NULL;
+	memcpy(glyphs, image->glyphs, sizeof image->glyphs);
+	texture_data->max_char_width = image->metrics.max_char_width;
+	texture_data->max_char_height = image->metrics.max_char_height;
+	texture_data->texture_width = image->metrics.texture_width;
+	texture_data->texture_height = image->metrics.texture_height;
+	texture_data->pixel_size = image->metrics.pixel_size;
+}
+
+/* BEGIN ATLAS REBUILD CODE */
+
+/* runs on the worker thread with a private freetype instance, since faces
+ * cannot be shared between threads. the first atlas is built here too, while
+ * the main thread waits on the compositor */
+static void *atlas_build_thread(void *data) {
+	struct atlas_builder *builder = data;
+	FT_Library library;
+	FT_Face face;
+	char done = 1;
+	builder->ok = false;
+	if(FT_Init_FreeType(&library) != 0) {
+		fprintf(stderr,"atlas rebuild: failed to open freetype\n");
+		goto notify;
+	}
+	if(FT_New_Face(library, builder->font_path, 0, &face) != 0) {
+		fprintf(stderr,"atlas rebuild: failed to open %s\n", builder->font_path);
+		FT_Done_FreeType(library);
+		goto notify;
+	}
+	uint64_t build_start = monotonic_ns();
+	FT_Set_Pixel_Sizes(face, 0, builder->pixel_size);
+	builder->image.metrics.sdf = builder->sdf;
+	builder->image.metrics.padding = builder->sdf ? SDF_SPREAD : 0;
+	if(builder->sdf) {
+		FT_Int spread = SDF_SPREAD;
+		FT_Property_Set(library, "sdf", "spread", &spread);
+	}
+	builder->image.metrics.pixel_size = builder->pixel_size;
+	builder->ok = rasterize_atlas(face, &builder->image) == 0;
+	record_histogram(&metrics.atlas_build_ns, monotonic_ns() - build_start);
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+notify:
+	write(builder->notify_fd[1], &done, 1);
+	return NULL;
+}
+
+static void start_atlas_build(struct display *display, int pixel_size) {
+	struct atlas_builder *builder = &display->atlas_builder;
+	if(builder->running) {
+		builder->pending_size = pixel_size;
+		return;
+	}
+	builder->pending_size = 0;
+	if(pixel_size == display->texture_data->pixel_size)
+		return;
+	builder->pixel_size = pixel_size;
+	builder->sdf = display->texture_data->sdf;
+	builder->running = true;
+	builder->threaded = pthread_create(&builder->thread, NULL, atlas_build_thread, builder) == 0;
+	/* build on this thread instead; it still signals the pipe, so
+	 * finish_atlas_build does not wait for a worker that never ran */
+	if(!builder->threaded) {
+		fprintf(stderr,"failed to start atlas rebuild thread, building inline\n");
+		atlas_build_thread(builder);
+	}
+}
+
+/* called on the render thread once the worker has signalled; swaps the new
+ * atlas in together with every grid and pty size so they never disagree */
+static void finish_atlas_build(struct display *display) {
+	struct atlas_builder *builder = &display->atlas_builder;
+	struct session *session;
+	char done;
+	read(builder->notify_fd[0], &done, 1);
+	if(builder->threaded)
+		pthread_join(builder->thread, NULL);
+	builder->running = false;
+	if(builder->ok) {
+		upload_atlas(display->gl_data, display->texture_data,
+			*display->glyphs, &builder->image);
+		/* glyphs past ascii keep their old bitmaps and are rasterized again
+		 * at the new size a frame's worth at a time, as rows are rebuilt */
+		wl_list_for_each(session, &display->sessions, link)
+			cell_size_changed(&session->render_data);
+	}
+	if(builder->pending_size != 0)
+		start_atlas_build(display, builder->pending_size);
+}
+
+/* END ATLAS REBUILD CODE */
+
+void init_screen(struct screen *screen) {
+	memset(screen->terminal_cells, 0, sizeof screen->terminal_cells);
+	memset(screen->links, 0, sizeof screen->links);
+	screen->links_used = false;
+	memset(screen->marks, 0, sizeof screen->marks);
+	screen->marks_used = false;
+	mark_screen_dirty(screen);
+	screen->term_x = 0;
+	screen->term_y = 0;
+	screen->saved_x = 0;
+	screen->saved_y = 0;
+	screen->cols = TERM_WIDTH;
+	screen->rows = TERM_HEIGHT;
+	screen->base_line = 0;
+	screen->scrollback = NULL;
+}
+
+/* open the font chain and size the primary face; needs no gl context, so it
+ * runs while the compositor answers. returns 1 when no font could be opened */
+int init_fonts(struct freetype_data *ft_data, struct texture_data *texture_data,
+		struct font_chain *fonts, const char **font_paths, int nfont_paths) {
+	ft_data->status = FT_Init_FreeType (& ft_data->value);
+    if (ft_data->status != 0) {
+		fprintf (stderr, "Error %d opening library.\n", ft_data->status);
+		return 1;
+    }
+	if (load_font_chain(ft_data->value, fonts, font_paths, nfont_paths) == 0) {
+		fprintf (stderr, "none of the configured fonts could be opened\n");
+		return 1;
+	}
+	ft_data->face = fonts->faces[0].face;
+	if (init_coverage(fonts) != 0)
+		return 1;
+	FT_Set_Pixel_Sizes(ft_data->face, 0, FONT_PIXEL_SIZE);
+    texture_data->texture_width = 0;
+	texture_data->texture_height = 0;
+	texture_data->max_char_height = 0;
+	texture_data->max_char_width = 0;
+	texture_data->scale = 1;
+	/* no atlas yet; the first build sets it */
+	texture_data->pixel_size = 0;
+	texture_data->padding = 0;
+	if(texture_data->sdf) {
+		FT_Int spread = SDF_SPREAD;
+		if(FT_Property_Set(ft_data->value, "sdf", "spread", &spread) != 0) {
+			fprintf(stderr,"freetype has no sdf renderer, using bitmaps\n");
+			texture_data->sdf = false;
+		} else {
+			texture_data->padding = SDF_SPREAD;
+		}
+	}
+	fonts->faces[0].pixel_size = FONT_PIXEL_SIZE;
+	return 0;
+}
+
+/* returns 1 when the shader program could not be built */
+int init_gl_stuff(struct opengl_data *gl_data) {
+	gl_text_prog = compile_text_program();
+	if(gl_text_prog == 0) {
+		fprintf(stderr, "failed to compile shader program\n");
+		return 1;
+	}
+	gl_data->attribute_coord = glGetAttribLocation(gl_text_prog, "coord");
+	gl_data->uniform_text = glGetUniformLocation(gl_text_prog, "text");
+	gl_data->uniform_color = glGetUniformLocation(gl_text_prog, "color");
+	if(gl_data->attribute_coord == -1 || gl_data->uniform_text == -1 || gl_data->uniform_color == -1)
+		fprintf(stderr,"failed to get shader attr or uniform\n");
+	gl_data->uniform_transform = glGetUniformLocation(gl_text_prog, "transform");
+	gl_data->texture = 0;
+	gl_data->uniform_sdf = glGetUniformLocation(gl_text_prog, "sdf");
+	if(gl_data->uniform_transform == -1 || gl_data->uniform_sdf == -1)
+		fprintf(stderr,"failed to get shader attr or uniform\n");
+	gl_data->attribute_page = glGetAttribLocation(gl_text_prog, "page");
+	gl_data->uniform_extra = glGetUniformLocation(gl_text_prog, "extra");
+	gl_data->uniform_emoji = glGetUniformLocation(gl_text_prog, "emoji");
+	if(gl_data->attribute_page == -1 || gl_data->uniform_extra == -1 || gl_data->uniform_emoji == -1)
+		fprintf(stderr,"failed to get shader attr or uniform\n");
+	return 0;
+}
+
+// Wayland Client Methods
+
+int display_connect(struct display *display) {
+	display->wl_display = wl_display_connect(NULL);
+	display->compositor = NULL;
+	display->xdg_wm_base = NULL;
+	display->egl_display = EGL_NO_DISPLAY;
+	display->egl_context = EGL_NO_CONTEXT;
+	display->gl_data = NULL;
+	display->texture_data = NULL;
+	display->glyphs = NULL;
+	memset(&display->glyph_cache, 0, sizeof display->glyph_cache);
+	memset(&display->atlas_builder, 0, sizeof display->atlas_builder);
+	display->zoom = 1;
+	wl_list_init(&display->sessions);
+	display->keyboard_focus = NULL;
+	display->new_session_pending = false;
+	display->pointer_focus = NULL;
+	display->context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (display->wl_display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		return 1;
+	}
+   	display->egl_display = eglGetDisplay((EGLNativeDisplayType)display->wl_display);
+	if(!display->context) {
+        fprintf(stderr, "Couldn't create xkb context\n");
+		return 1;
+    }
+	return 0;
+}
+
+void session_destroy(struct session *session);
+
+void display_disconnect(struct display *display) {
+	struct session *session, *tmp;
+	wl_list_for_each_safe(session, tmp, &display->sessions, link)
+		session_destroy(session);
+	if(display->compositor)
+		wl_compositor_destroy(display->compositor);
+	xkb_context_unref(display->context);
+	wl_display_disconnect(display->wl_display);
+}
+
+/* TODO: rename this */
+/* waits for the globals asked for with the registry listener */
+int wl_initialize_compositor(struct display *display) {
+	wl_display_dispatch(display->wl_display);
+	wl_display_roundtrip(display->wl_display);
+	if (display->compositor == NULL || display->xdg_wm_base == NULL) {
+		fprintf(stderr, "no wl_shm, wl_compositor or xdg_wm_base support\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* TODO: rename */
+/* the display came from display_connect */
+int wl_initialize_egl(struct display *display, struct egl *egl) {
+	if (display->egl_display == EGL_NO_DISPLAY) {
+		fprintf(stderr, "failed to create EGL display\n");
+		return 1;
+	}
+	if (!eglInitialize(display->egl_display, &egl->major, &egl->minor)) {
+		fprintf(stderr, "failed to initialize EGL\n");
+		return 1;
+	}
+	eglChooseConfig(display->egl_display, egl->config_attribs, &egl->egl_config, 1, &egl->n);
+	if (egl->n == 0) {
+		fprintf(stderr, "failed to choose an EGL config\n");
+		return 1;
+	}
+	
+	display->egl_config = egl->egl_config;
+	display->egl_context = eglCreateContext(display->egl_display, egl->egl_config,
+		EGL_NO_CONTEXT, egl->context_attribs);
+	if (display->egl_context == EGL_NO_CONTEXT) {
+		fprintf(stderr, "eglCreateContext failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* TODO: rename */
+int wl_init_surface(struct session *session) {
+	struct display *display = session->display;
+	session->wl_surface = wl_compositor_create_surface(display->compositor);
+	session->xdg_surface = xdg_wm_base_get_xdg_surface(display->xdg_wm_base, session->wl_surface);
+	session->xdg_toplevel = xdg_surface_get_toplevel(session->xdg_surface);
+	xdg_surface_add_listener(session->xdg_surface, &xdg_surface_listener, session);
+	xdg_toplevel_add_listener(session->xdg_toplevel, &xdg_toplevel_listener, session);
+	return 0;
+}
+
+int more_egl_init(struct session *session) {
+	struct display *display = session->display;
+	session->egl_window = wl_egl_window_create(session->wl_surface, session->width, session->height);
+	if (session->egl_window == NULL) {
+		fprintf(stderr, "wl_egl_window_create failed\n");
+		return 1;
+	}
+	session->egl_surface = eglCreateWindowSurface(display->egl_display, display->egl_config,
+		(EGLNativeWindowType)session->egl_window, NULL);
+	if (session->egl_surface == EGL_NO_SURFACE) {
+		fprintf(stderr, "eglCreateWindowSurface failed\n");
+		return 1;
+	}
+	if (!eglMakeCurrent(display->egl_display, session->egl_surface, session->egl_surface, display->egl_context)) {
+		fprintf(stderr, "eglMakeCurrent failed\n");
+		return 1;
+	}
+	eglSwapInterval(display->egl_display, 0);
+	return 0;
+}
+
+/* BEGIN SESSION CODE */
+
+/* create a window sharing the display's context; its grid is empty and no
+ * shell runs until session_start, which needs the glyph atlas */
+struct session *session_create(struct display *display) {
+	if(wl_list_length(&display->sessions) >= MAX_SESSIONS) {
+		fprintf(stderr,"too many sessions\n");
+		return NULL;
+	}
+	struct session *session = calloc(1, sizeof *session);
+	if(session == NULL) {
+		fprintf(stderr,"failed to allocate session\n");
+		return NULL;
+	}
+	session->display = display;
+	session->width = width;
+	session->height = height;
+	session->pty.master_fd = -1;
+	session->pty.slave_fd = -1;
+	session->snapshot.fd = -1;
+	wl_list_insert(display->sessions.prev, &session->link);
+	wl_init_surface(session);
+	wl_surface_commit(session->wl_surface);
+	wl_display_roundtrip(display->wl_display);
+	if(more_egl_init(session) > 0) {
+		session_destroy(session);
+		return NULL;
+	}
+
+	struct render_data *render_data = &session->render_data;
+	init_screen(&session->primary);
+	init_screen(&session->alternate);
+	session->primary.scrollback = &session->scrollback;
+	render_data->display = display;
+	render_data->session = session;
+	render_data->texture_data = display->texture_data;
+	render_data->glyphs = display->glyphs;
+	render_data->gl_data = display->gl_data;
+	render_data->screen = &session->primary;
+	render_data->primary = &session->primary;
+	render_data->alternate = &session->alternate;
+	invalidate_ring(render_data);
+	/* storage for the whole vertex ring; slots are filled with glBufferSubData */
+	glGenBuffers(1,&render_data->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER,render_data->vbo);
+	glBufferData(GL_ARRAY_BUFFER, RING_ROWS * RING_SLOT_POINTS * sizeof(struct point),
+		NULL, GL_DYNAMIC_DRAW);
+	return session;
+}
+
+/* size the grid, spawn the shell unless one was handed in, and draw the
+ * first frame */
+void session_start(struct session *session, bool spawn_shell) {
+	struct render_data *render_data = &session->render_data;
+	resize_grid(render_data);
+	if(spawn_shell)
+		setup_new_tty(&session->pty);
+	if(session->pty.master_fd >= 0)
+		resize_pty(&session->pty, render_data->screen, render_data->texture_data);
+	render_cells(render_data);
+}
+
+void session_destroy(struct session *session) {
+	struct display *display = session->display;
+	struct scrollback *scrollback = &session->scrollback;
+	int i;
+	if(display->keyboard_focus == session)
+		display->keyboard_focus = NULL;
+	if(display->pointer_focus == session)
+		display->pointer_focus = NULL;
+	if(session->snapshot.fd >= 0) {
+		write_snapshot(session);
+		close(session->snapshot.fd);
+	}
+	if(session->render_data.frame_callback)
+		wl_callback_destroy(session->render_data.frame_callback);
+	if(session->egl_surface != EGL_NO_SURFACE && session->egl_surface != NULL) {
+		eglMakeCurrent(display->egl_display, session->egl_surface, session->egl_surface, display->egl_context);
+		if(session->render_data.vbo)
+			glDeleteBuffers(1, &session->render_data.vbo);
+		free_graphics(session);
+		eglMakeCurrent(display->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroySurface(display->egl_display, session->egl_surface);
+	}
+	if(session->egl_window)
+		wl_egl_window_destroy(session->egl_window);
+	if(session->xdg_toplevel)
+		xdg_toplevel_destroy(session->xdg_toplevel);
+	if(session->xdg_surface)
+		xdg_surface_destroy(session->xdg_surface);
+	if(session->wl_surface)
+		wl_surface_destroy(session->wl_surface);
+	free_links(&session->links);
+	/* closing the master hangs up the shell */
+	if(session->pty.master_fd >= 0)
+		close(session->pty.master_fd);
+	for(i = 0; i < SCROLLBACK_MAX_PAGES; i++) {
+		char *page = (char *)scrollback->pages[i];
+		char *mapping = scrollback->mapping;
+		if(mapping && page >= mapping && page < mapping + scrollback->mapping_size)
+			continue;
+		free(page);
+	}
+	if(scrollback->mapping)
+		munmap(scrollback->mapping, scrollback->mapping_size);
+	if(session->search.compiled_ok)
+		regfree(&session->search.compiled);
+	free(session->search.history.items);
+	free(session->search.screen.items);
+	free(session->search.row_matches.items);
+	wl_list_remove(&session->link);
+	free(session);
+}
+
+/* END SESSION CODE */
+
+/* write codepoint as utf-8, returning the number of bytes (at most 4) */
+static int encode_utf8(uint32_t codepoint, char *out) {
+	if(codepoint < 0x80) {
+		out[0] = codepoint;
+		return 1;
+	}
+	if(codepoint < 0x800) {
+		out[0] = 0xc0 | codepoint >> 6;
+		out[1] = 0x80 | (codepoint & 0x3f);
+		return 2;
+	}
+	if(codepoint < 0x10000) {
+		out[0] = 0xe0 | codepoint >> 12;
+		out[1] = 0x80 | (codepoint >> 6 & 0x3f);
+		out[2] = 0x80 | (codepoint & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | codepoint >> 18;
+	out[1] = 0x80 | (codepoint >> 12 & 0x3f);
+	out[2] = 0x80 | (codepoint >> 6 & 0x3f);
+	out[3] = 0x80 | (codepoint & 0x3f);
+	return 4;
+}
+
+/* BEGIN SEARCH CODE */
+
+/* first occurrence of needle in hay at or after from, or -1. the sse2 path
+ * tests 4 start positions at once against the first and last needle cells
+ * and only compares the candidates that pass both */
+static int find_substring(const uint32_t *hay, int len, const uint32_t *needle, int nlen, int from) {
+	int i = from;
+	if(nlen == 0 || nlen > len)
+		return -1;
+#ifdef __SSE2__
+	__m128i first = _mm_set1_epi32(needle[0]);
+	__m128i last = _mm_set1_epi32(needle[nlen - 1]);
+	for(; i + nlen - 1 + 4 <= len; i += 4) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+		unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(
+			_mm_cmpeq_epi32(first, block_first), _mm_cmpeq_epi32(last, block_last))));
+		while(mask) {
+			int lane = __builtin_ctz(mask);
+			if(memcmp(hay + i + lane, needle, nlen * sizeof *needle) == 0)
+				return i + lane;
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for(; i + nlen <= len; i++) {
+		if(hay[i] == needle[0] && memcmp(hay + i, needle, nlen * sizeof *needle) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void match_list_add(struct match_list *list, uint64_t line, int col) {
+	if(list->count == list->capacity) {
+		/* reclaim the recycled prefix before growing */
+		if(list->first > 0) {
+			memmove(list->items, list->items + list->first,
+				(list->count - list->first) * sizeof *list->items);
+			list->count -= list->first;
+			list->first = 0;
+		}
+		if(list->count == list->capacity) {
+			size_t capacity = list->capacity ? list->capacity * 2 : 64;
+			struct search_match *items = realloc(list->items, capacity * sizeof *items);
+			if(items == NULL) {
+				fprintf(stderr,"failed to grow search matches\n");
+				return;
+			}
+			list->items = items;
+			list->capacity = capacity;
+		}
+	}
+	list->items[list->count].line = line;
+	list->items[list->count].col = col;
+	list->count++;
+}
+
+static size_t match_list_size(struct match_list *list) {
+	return list->count - list->first;
+}
+
+/* the k-th match counting history matches first, then the screen's */
+static struct search_match *search_match_at(struct search *search, size_t k) {
+	size_t history = match_list_size(&search->history);
+	if(k < history)
+		return &search->history.items[search->history.first + k];
+	return &search->screen.items[search->screen.first + k - history];
+}
+
+static size_t search_total(struct search *search) {
+	return match_list_size(&search->history) + match_list_size(&search->screen);
+}
+
+/* record every match of the query in one line of cells */
+static void search_line(struct search *search, struct match_list *list,
+		const uint32_t *cells, int cols, uint64_t line) {
+	if(search->regex) {
+		char text[TERM_WIDTH * 4 + 1];
+		/* cell each byte of text came from */
+		unsigned char col_of[TERM_WIDTH * 4 + 1];
+		regmatch_t match;
+		int i, len = 0, from = 0;
+		if(!search->compiled_ok)
+			return;
+		/* empty cells are 0; regexec needs one string */
+		for(i = 0; i < cols; i++) {
+			int n = encode_utf8(cells[i] ? cells[i] : ' ', text + len);
+			memset(col_of + len, i, n);
+			len += n;
+		}
+		text[len] = '\0';
+		col_of[len] = cols;
+		while(from < len && regexec(&search->compiled, text + from, 1, &match,
+				from ? REG_NOTBOL : 0) == 0) {
+			match_list_add(list, line, col_of[from + match.rm_so]);
+			from += match.rm_eo > match.rm_so ? match.rm_eo : match.rm_so + 1;
+		}
+		return;
+	}
+	int col = 0;
+	while((col = find_substring(cells, cols, search->needle, search->query_len, col)) >= 0) {
+		match_list_add(list, line, col);
+		col++;
+	}
+}
+
+/* whether a scrollback page can hold a plain text match at all */
+static bool page_may_match(struct search *search, struct scrollback *scrollback, uint64_t line) {
+	uint64_t *present = scrollback->bytes_present[(line / SCROLLBACK_PAGE_LINES) % SCROLLBACK_MAX_PAGES];
+	int i;
+	if(search->regex)
+		return true;
+	for(i = 0; i < search->query_len; i++) {
+		unsigned char c = search->query[i];
+		if(!(present[c >> 6] & ((uint64_t)1 << (c & 63))))
+			return false;
+	}
+	return true;
+}
+
+static void search_update_title(struct session *session) {
+	struct search *search = &session->search;
+	char title[SEARCH_QUERY_MAX + 64];
+	size_t total = search_total(search);
+	size_t index = 0;
+	if(!search->active) {
+		xdg_toplevel_set_title(session->xdg_toplevel, "gl_text");
+		return;
+	}
+	if(search->has_current) {
+		for(index = 0; index < total; index++) {
+			struct search_match *match = search_match_at(search, index);
+			if(match->line == search->current.line && match->col == search->current.col)
+				break;
+		}
+	}
+	snprintf(title, sizeof title, "%s: %s%s [%zu/%zu]",
+		search->regex ? "regex" : "search", search->query,
+		search->regex && !search->compiled_ok && search->query_len ? " (invalid)" : "",
+		search->has_current && index < total ? index + 1 : 0, total);
+	xdg_toplevel_set_title(session->xdg_toplevel, title);
+}
+
+/* start over after the query changed */
+static void search_reset(struct session *session) {
+	struct search *search = &session->search;
+	int i;
+	search->history.first = search->history.count = 0;
+	search->screen.first = search->screen.count = 0;
+	for(i = 0; i < TERM_HEIGHT; i++)
+		search->rows[i].valid = false;
+	search->screen_rows = -1;
+	search->scanned_line = session->scrollback.first_line;
+	search->has_current = false;
+	for(i = 0; i < search->query_len; i++)
+		search->needle[i] = (unsigned char)search->query[i];
+	if(search->compiled_ok)
+		regfree(&search->compiled);
+	search->compiled_ok = search->regex && search->query_len > 0
+		&& regcomp(&search->compiled, search->query, REG_EXTENDED) == 0;
+	search->shown_total = (size_t)-1;
+}
+
+/* rescan the screen rows written since the last scan, and rebuild the
+ * screen list if any row or the screen's position changed */
+static void search_scan_screen(struct search *search, struct screen *screen) {
+	bool changed = search->screen_base != screen->base_line || search->screen_rows != screen->rows;
+	int row, i;
+	for(row = 0; row < screen->rows; row++) {
+		uint64_t line = screen->base_line + row;
+		struct search_row *cached = &search->rows[line % TERM_HEIGHT];
+		if(cached->valid && cached->line == line && !(screen->dirty[row] & DIRTY_SEARCH))
+			continue;
+		search->row_matches.first = search->row_matches.count = 0;
+		search_line(search, &search->row_matches, screen->terminal_cells[row], screen->cols, line);
+		cached->valid = true;
+		cached->line = line;
+		cached->count = 0;
+		/* a regex can match at every byte of a multibyte cell; columns come
+		 * in order, so dropping repeats leaves at most one per cell */
+		for(i = 0; i < (int)search->row_matches.count && cached->count < TERM_WIDTH; i++) {
+			int col = search->row_matches.items[i].col;
+			if(cached->count == 0 || cached->cols[cached->count - 1] != col)
+				cached->cols[cached->count++] = col;
+		}
+		screen->dirty[row] &= ~DIRTY_SEARCH;
+		changed = true;
+	}
+	if(!changed)
+		return;
+	search->screen_base = screen->base_line;
+	search->screen_rows = screen->rows;
+	search->screen.first = search->screen.count = 0;
+	for(row = 0; row < screen->rows; row++) {
+		struct search_row *cached = &search->rows[(screen->base_line + row) % TERM_HEIGHT];
+		for(i = 0; i < cached->count; i++)
+			match_list_add(&search->screen, cached->line, cached->cols[i]);
+	}
+}
+
+/* scan history for at most SEARCH_SLICE_NS and the changed screen rows.
+ * returns true while history is left, so the main loop polls without waiting */
+static bool search_scan(struct session *session) {
+	struct search *search = &session->search;
+	struct scrollback *scrollback = &session->scrollback;
+	struct screen *screen = &session->primary;
+	uint64_t start = monotonic_ns();
+	if(!search->active || search->query_len == 0)
+		return false;
+	/* drop matches in recycled pages */
+	while(search->history.first < search->history.count
+			&& search->history.items[search->history.first].line < scrollback->first_line)
+		search->history.first++;
+	if(search->scanned_line < scrollback->first_line)
+		search->scanned_line = scrollback->first_line;
+	while(search->scanned_line < scrollback->end_line) {
+		uint64_t line = search->scanned_line;
+		if(line % SCROLLBACK_PAGE_LINES == 0 && !page_may_match(search, scrollback, line)) {
+			search->scanned_line = line + SCROLLBACK_PAGE_LINES;
+			if(search->scanned_line > scrollback->end_line)
+				search->scanned_line = scrollback->end_line;
+			continue;
+		}
+		search_line(search, &search->history, scrollback_line(scrollback, line), TERM_WIDTH, line);
+		search->scanned_line++;
+		if(search->scanned_line % 64 == 0 && monotonic_ns() - start >= SEARCH_SLICE_NS)
+			break;
+	}
+	search_scan_screen(search, screen);
+	if(search_total(search) != search->shown_total) {
+		search->shown_total = search_total(search);
+		search_update_title(session);
+	}
+	return search->scanned_line < scrollback->end_line;
+}
+
+static void search_toggle(struct session *session) {
+	struct search *search = &session->search;
+	search->active = !search->active;
+	if(search->active) {
+		search->query_len = 0;
+		search->query[0] = '\0';
+		search_reset(session);
+	}
+	search_update_title(session);
+}
+
+/* append a character to the query, or remove the last one for '\b' */
+static void search_edit(struct session *session, int c) {
+	struct search *search = &session->search;
+	if(c == '\b') {
+		if(search->query_len == 0)
+			return;
+		search->query_len--;
+	} else {
+		if(search->query_len + 1 >= SEARCH_QUERY_MAX)
+			return;
+		search->query[search->query_len++] = c;
+	}
+	search->query[search->query_len] = '\0';
+	search_reset(session);
+	search_scan(session);
+	search_update_title(session);
+}
+
+static void search_toggle_regex(struct session *session) {
+	session->search.regex = !session->search.regex;
+	search_reset(session);
+	search_scan(session);
+	search_update_title(session);
+}
+
+/* select the nearest match before (older) or after the current one and
+ * scroll it to the middle of the view. without a current match, older
+ * starts from the newest */
+static void search_jump(struct session *session, bool older) {
+	struct search *search = &session->search;
+	struct render_data *render_data = &session->render_data;
+	size_t total, lo = 0, hi;
+	search_scan(session);
+	total = search_total(search);
+	if(total == 0)
+		return;
+	if(!search->has_current) {
+		lo = older ? total : 0;
+	} else {
+		/* matches are sorted: find the first one after the current */
+		hi = total;
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			struct search_match *match = search_match_at(search, mid);
+			if(match->line < search->current.line
+					|| (match->line == search->current.line && match->col <= search->current.col))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(older && lo > 0 && search_match_at(search, lo - 1)->line == search->current.line
+				&& search_match_at(search, lo - 1)->col == search->current.col)
+			lo--;
+	}
+	if(older) {
+		if(lo == 0)
+			return;
+		lo--;
+	} else if(lo == total) {
+		return;
+	}
+	search->current = *search_match_at(search, lo);
+	search->has_current = true;
+	if(render_data->screen == render_data->primary) {
+		render_data->scroll_lines = 0;
+		if(search->current.line < session->primary.base_line)
+			scroll_viewport(render_data, session->primary.base_line - search->current.line
+				+ session->primary.rows / 2);
+	}
+	search_update_title(session);
+}
+
+/* END SEARCH CODE */
+
+/* BEGIN SNAPSHOT CODE */
+
+static void save_snapshot_screen(struct snapshot_screen *out, const struct screen *screen) {
+	out->cols = screen->cols;
+	out->rows = screen->rows;
+	out->term_x = screen->term_x;
+	out->term_y = screen->term_y;
+	out->saved_x = screen->saved_x;
+	out->saved_y = screen->saved_y;
+	out->base_line = screen->base_line;
+	memcpy(out->cells, screen->terminal_cells, sizeof out->cells);
+}
+
+static void fill_snapshot_header(struct session *session, struct snapshot_header *header) {
+	memset(header, 0, sizeof *header);
+	memcpy(header->magic, SNAPSHOT_MAGIC, sizeof header->magic);
+	header->version = SNAPSHOT_VERSION;
+	header->term_width = TERM_WIDTH;
+	header->term_height = TERM_HEIGHT;
+	header->page_lines = SCROLLBACK_PAGE_LINES;
+	header->max_pages = SCROLLBACK_MAX_PAGES;
+	header->alternate_active = session->render_data.screen == &session->alternate;
+	header->first_line = session->scrollback.first_line;
+	header->end_line = session->scrollback.end_line;
+	memcpy(header->bytes_present, session->scrollback.bytes_present, sizeof header->bytes_present);
+	save_snapshot_screen(&header->primary, &session->primary);
+	save_snapshot_screen(&header->alternate, &session->alternate);
+}
+
+static off_t snapshot_page_offset(uint64_t page) {
+	return SNAPSHOT_PAGES_OFFSET + (off_t)(page % SCROLLBACK_MAX_PAGES) * sizeof(struct scrollback_page);
+}
+
+/* write what changed since the last snapshot: the pages from the one holding
+ * written_line on, then the header. before a page slot is reused, the header
+ * is narrowed to history that is still intact, so a crash part way through
+ * leaves a file that restores to the previous snapshot or better */
+static int write_snapshot(struct session *session) {
+	struct snapshot *snapshot = &session->snapshot;
+	struct scrollback *scrollback = &session->scrollback;
+	struct snapshot_header header;
+	uint64_t page;
+	if(snapshot->fd < 0)
+		return 0;
+	snapshot->last_ns = monotonic_ns();
+	if(snapshot->written_line < scrollback->first_line)
+		snapshot->written_line = scrollback->first_line;
+	uint64_t lines[3] = {1, scrollback->first_line, snapshot->written_line};
+	if(pwrite(snapshot->fd, lines, sizeof lines, offsetof(struct snapshot_header, narrowed)) != sizeof lines)
+		goto fail;
+	for(page = snapshot->written_line / SCROLLBACK_PAGE_LINES;
+			page * SCROLLBACK_PAGE_LINES < scrollback->end_line; page++) {
+		if(pwrite(snapshot->fd, scrollback->pages[page % SCROLLBACK_MAX_PAGES],
+				sizeof(struct scrollback_page), snapshot_page_offset(page))
+				!= sizeof(struct scrollback_page))
+			goto fail;
+	}
+	fill_snapshot_header(session, &header);
+	if(pwrite(snapshot->fd, &header, sizeof header, 0) != sizeof header)
+		goto fail;
+	snapshot->written_line = scrollback->end_line;
+	return 0;
+fail:
+	fprintf(stderr,"snapshot: write failed: %s\n", strerror(errno));
+	return 1;
+}
+
+static bool restore_snapshot_screen(struct screen *screen, const struct snapshot_screen *in) {
+	if(in->cols < 1 || in->cols > TERM_WIDTH || in->rows < 1 || in->rows > TERM_HEIGHT
+			|| in->term_x < 0 || in->term_x > in->cols || in->term_y < 0 || in->term_y >= in->rows
+			|| in->saved_x < 0 || in->saved_x > in->cols || in->saved_y < 0 || in->saved_y >= in->rows)
+		return false;
+	screen->cols = in->cols;
+	screen->rows = in->rows;
+	screen->term_x = in->term_x;
+	screen->term_y = in->term_y;
+	screen->saved_x = in->saved_x;
+	screen->saved_y = in->saved_y;
+	screen->base_line = in->base_line;
+	memcpy(screen->terminal_cells, in->cells, sizeof screen->terminal_cells);
+	memset(screen->links, 0, sizeof screen->links);
+	screen->links_used = false;
+	memset(screen->marks, 0, sizeof screen->marks);
+	screen->marks_used = false;
+	mark_screen_dirty(screen);
+	return true;
+}
+
+/* map the file and take the history from it in place; only the two grids
+ * are copied. false if the file is not a usable snapshot */
+static bool restore_snapshot(struct session *session) {
+	struct snapshot *snapshot = &session->snapshot;
+	struct scrollback *scrollback = &session->scrollback;
+	const struct snapshot_header *header;
+	struct stat st;
+	uint64_t page;
+	void *map;
+	if(fstat(snapshot->fd, &st) != 0 || (size_t)st.st_size < SNAPSHOT_PAGES_OFFSET)
+		return false;
+	/* private, so lines pushed into a restored page stay out of the file
+	 * until the next snapshot writes them */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snapshot->fd, 0);
+	if(map == MAP_FAILED)
+		return false;
+	header = map;
+	if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0
+			|| header->version != SNAPSHOT_VERSION
+			|| header->term_width != TERM_WIDTH || header->term_height != TERM_HEIGHT
+			|| header->page_lines != SCROLLBACK_PAGE_LINES || header->max_pages != SCROLLBACK_MAX_PAGES
+			|| header->first_line % SCROLLBACK_PAGE_LINES != 0
+			|| header->end_line < header->first_line
+			|| header->end_line - header->first_line > (uint64_t)SCROLLBACK_PAGE_LINES * SCROLLBACK_MAX_PAGES
+			|| header->primary.base_line < header->end_line
+			|| (!header->narrowed && header->primary.base_line != header->end_line))
+		goto reject;
+	for(page = header->first_line / SCROLLBACK_PAGE_LINES;
+			page * SCROLLBACK_PAGE_LINES < header->end_line; page++) {
+		if(snapshot_page_offset(page) + sizeof(struct scrollback_page) > (size_t)st.st_size)
+			goto reject;
+	}
+	if(!restore_snapshot_screen(&session->primary, &header->primary)
+			|| !restore_snapshot_screen(&session->alternate, &header->alternate))
+		goto reject;
+	/* after a crash between the narrowing and the full header write, the
+	 * lines between the intact history and the grid are gone; the grid
+	 * follows straight on from the history */
+	session->primary.base_line = header->end_line;
+	scrollback->first_line = header->first_line;
+	scrollback->end_line = header->end_line;
+	memcpy(scrollback->bytes_present, header->bytes_present, sizeof scrollback->bytes_present);
+	for(page = header->first_line / SCROLLBACK_PAGE_LINES;
+			page * SCROLLBACK_PAGE_LINES < header->end_line; page++)
+		scrollback->pages[page % SCROLLBACK_MAX_PAGES] =
+			(struct scrollback_page *)((char *)map + snapshot_page_offset(page));
+	scrollback->mapping = map;
+	scrollback->mapping_size = st.st_size;
+	if(header->alternate_active)
+		session->render_data.screen = &session->alternate;
+	invalidate_ring(&session->render_data);
+	snapshot->written_line = header->end_line;
+	return true;
+reject:
+	/* a partly restored grid is cleared again */
+	init_screen(&session->primary);
+	init_screen(&session->alternate);
+	session->primary.scrollback = scrollback;
+	munmap(map, st.st_size);
+	return false;
+}
+
+/* attach a snapshot file to a session, restoring from it when it holds one */
+static int open_snapshot(struct session *session, const char *path) {
+	struct snapshot *snapshot = &session->snapshot;
+	struct snapshot_header header;
+	snapshot->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(snapshot->fd < 0) {
+		fprintf(stderr,"snapshot: cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if(restore_snapshot(session)) {
+		printf("restored %s\n", path);
+		snapshot->last_ns = monotonic_ns();
+		return 0;
+	}
+	/* start the file over with the empty session */
+	if(ftruncate(snapshot->fd, 0) != 0) {
+		fprintf(stderr,"snapshot: cannot truncate %s: %s\n", path, strerror(errno));
+		close(snapshot->fd);
+		snapshot->fd = -1;
+		return 1;
+	}
+	fill_snapshot_header(session, &header);
+	snapshot->written_line = 0;
+	if(pwrite(snapshot->fd, &header, sizeof header, 0) != sizeof header)
+		fprintf(stderr,"snapshot: write failed: %s\n", strerror(errno));
+	snapshot->last_ns = monotonic_ns();
+	return 0;
+}
+
+/* ms until the session is due a periodic snapshot, -1 if it has no file */
+static int snapshot_timeout(struct session *session) {
+	uint64_t elapsed;
+	if(session->snapshot.fd < 0)
+		return -1;
+	elapsed = (monotonic_ns() - session->snapshot.last_ns) / 1000000;
+	return elapsed >= SNAPSHOT_INTERVAL_MS ? 0 : SNAPSHOT_INTERVAL_MS - elapsed;
+}
+
+/* END SNAPSHOT CODE */
+
+/* BEGIN LINK CODE */
+
+/* links come from osc 8, which tags cells with an interned target as they are
+ * written, and from urls in the text. neither costs the parser more than a
+ * store per cell: rows are only searched when the renderer rebuilds their
+ * ring slot, which it does for rows that changed or scrolled into view, and
+ * what it finds is kept with the slot until then */
+
+static uint32_t hash_uri(const char *uri) {
+	uint32_t hash = 2166136261u;
+	for(; *uri; uri++)
+		hash = (hash ^ (unsigned char)*uri) * 16777619u;
+	return hash;
+}
+
+static void index_uri(struct link_table *table, uint16_t id) {
+	uint32_t mask = LINK_MAX_URIS * 2 - 1;
+	uint32_t slot = hash_uri(table->uris[id - 1]) & mask;
+	while(table->index[slot] != 0)
+		slot = (slot + 1) & mask;
+	table->index[slot] = id;
+}
+
+static void mark_screen_uris(struct screen *screen, bool *used) {
+	int row, col;
+	if(!screen->links_used)
+		return;
+	for(row = 0; row < TERM_HEIGHT; row++) {
+		for(col = 0; col < TERM_WIDTH; col++)
+			used[screen->links[row][col]] = true;
+	}
+}
+
+/* free the uris nothing refers to any more: not the parser, no cell on
+ * either screen, no history span and no link kept with a ring slot. ids
+ * whose spans have aged out of history are handed out again */
+static void sweep_uris(struct session *session) {
+	struct link_table *table = &session->links;
+	struct render_data *render_data = &session->render_data;
+	bool used[LINK_MAX_URIS] = { false };
+	uint32_t i;
+	int j;
+	used[render_data->parser.link] = true;
+	mark_screen_uris(&session->primary, used);
+	mark_screen_uris(&session->alternate, used);
+	for(i = 0; i < session->scrollback.link_spans_count; i++)
+		used[session->scrollback.link_spans[i].uri] = true;
+	for(i = 0; i < RING_ROWS; i++) {
+		for(j = 0; j < render_data->ring_links[i].count; j++)
+			used[render_data->ring_links[i].spans[j].uri] = true;
+	}
+	/* open addressing has no deletion, so the index is built again */
+	memset(table->index, 0, sizeof table->index);
+	for(j = 1; j <= table->count; j++) {
+		if(table->uris[j - 1] == NULL)
+			continue;
+		if(used[j]) {
+			index_uri(table, j);
+		} else {
+			free(table->uris[j - 1]);
+			table->uris[j - 1] = NULL;
+		}
+	}
+}
+
+/* the id of uri, adding it when new; 0 when every id is still in use */
+static uint16_t intern_uri(struct session *session, const char *uri) {
+	struct link_table *table = &session->links;
+	uint32_t mask = LINK_MAX_URIS * 2 - 1;
+	uint32_t slot = hash_uri(uri) & mask;
+	uint16_t id;
+	char *copy;
+	while(table->index[slot] != 0) {
+		id = table->index[slot];
+		if(strcmp(table->uris[id - 1], uri) == 0)
+			return id;
+		slot = (slot + 1) & mask;
+	}
+	if((copy = strdup(uri)) == NULL)
+		return 0;
+	if(table->count < LINK_MAX_URIS - 1) {
+		id = ++table->count;
+	} else {
+		sweep_uris(session);
+		for(id = 1; id <= table->count && table->uris[id - 1] != NULL; id++)
+			;
+		if(id > table->count) {
+			free(copy);
+			return 0;
+		}
+	}
+	table->uris[id - 1] = copy;
+	index_uri(table, id);
+	return id;
+}
+
+static void free_links(struct link_table *table) {
+	int i;
+	for(i = 0; i < table->count; i++)
+		free(table->uris[i]);
+	table->count = 0;
+}
+
+/* OSC 8 ; params ; uri starts a link and an empty uri ends it. other
+ * operating system commands are ignored */
+static void dispatch_osc(struct render_data *render_data) {
+	struct parser *parser = &render_data->parser;
+	parser->osc[parser->osc_len] = '\0';
+	if(strncmp(parser->osc, "8;", 2) != 0)
+		return;
+	char *uri = strchr(parser->osc + 2, ';');
+	if(uri == NULL)
+		return;
+	uri++;
+	parser->link = *uri ? intern_uri(render_data->session, uri) : 0;
+}
+
+/* the k-th span in history, oldest first. lines leave the screen in order,
+ * so the spans are sorted by line */
+static struct link_span *history_link_span(struct scrollback *scrollback, uint32_t k) {
+	return &scrollback->link_spans[(scrollback->link_spans_next + LINK_HISTORY_SPANS
+		- scrollback->link_spans_count + k) % LINK_HISTORY_SPANS];
+}
+
+/* keep the runs of linked cells in a line leaving the screen */
+static void push_link_spans(struct scrollback *scrollback, uint64_t line, const uint16_t *links) {
+	int start = 0;
+	int i;
+	for(i = 1; i <= TERM_WIDTH; i++) {
+		if(i < TERM_WIDTH && links[i] == links[start])
+			continue;
+		if(links[start] != 0) {
+			scrollback->link_spans[scrollback->link_spans_next] = (struct link_span) {
+				line, start, i, links[start]
+			};
+			scrollback->link_spans_next = (scrollback->link_spans_next + 1) % LINK_HISTORY_SPANS;
+			if(scrollback->link_spans_count < LINK_HISTORY_SPANS)
+				scrollback->link_spans_count++;
+		}
+		start = i;
+	}
+}
+
+static bool add_row_link(struct row_links *links, int start, int end, uint16_t uri) {
+	if(links->count == ROW_LINKS_MAX)
+		return false;
+	links->spans[links->count++] = (struct link_span) { 0, start, end, uri };
+	return true;
+}
+
+static bool is_scheme_char(uint32_t c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| c == '+' || c == '-' || c == '.';
+}
+
+/* printable ascii that is not a delimiter around urls in text */
+static bool is_url_char(uint32_t c) {
+	return c > ' ' && c < 0x7f && c != '<' && c != '>' && c != '"' && c != '\''
+		&& c != '`' && c != '{' && c != '}' && c != '|' && c != '\\' && c != '^';
+}
+
+/* scheme://rest runs not already covered by an osc 8 link. sentence
+ * punctuation and an unmatched closing paren after a url are not part of it */
+static void detect_urls(const uint32_t *cells, struct row_links *links, int explicit) {
+	int i, j;
+	for(i = 1; i + 2 < TERM_WIDTH; i++) {
+		if(cells[i] != ':' || cells[i + 1] != '/' || cells[i + 2] != '/')
+			continue;
+		int start = i;
+		while(start > 0 && is_scheme_char(cells[start - 1]))
+			start--;
+		while(start < i && !((cells[start] >= 'a' && cells[start] <= 'z')
+				|| (cells[start] >= 'A' && cells[start] <= 'Z')))
+			start++;
+		int end = i + 3;
+		int parens = 0;
+		while(end < TERM_WIDTH && is_url_char(cells[end])) {
+			parens += cells[end] == '(' ? 1 : cells[end] == ')' ? -1 : 0;
+			end++;
+		}
+		while(end > i + 3) {
+			uint32_t last = cells[end - 1];
+			if(last == ')' && parens < 0)
+				parens++;
+			else if(!strchr(".,:;!?", last))
+				break;
+			end--;
+		}
+		if(start == i || end == i + 3) {
+			i += 2;
+			continue;
+		}
+		for(j = 0; j < explicit; j++) {
+			if(start < links->spans[j].end && end > links->spans[j].start)
+				break;
+		}
+		if(j == explicit && !add_row_link(links, start, end, 0))
+			return;
+		i = end;
+	}
+}
+
+static void find_row_links(struct render_data *render_data, int64_t line, const uint32_t *cells,
+		int row, struct row_links *links) {
+	struct screen *screen = render_data->screen;
+	struct scrollback *scrollback = screen->scrollback;
+	uint32_t i;
+	links->count = 0;
+	if(cells == NULL)
+		return;
+	if(row >= 0 && screen->links_used) {
+		const uint16_t *ids = screen->links[row];
+		int start = 0;
+		int j;
+		for(j = 1; j <= TERM_WIDTH; j++) {
+			if(j < TERM_WIDTH && ids[j] == ids[start])
+				continue;
+			if(ids[start] != 0)
+				add_row_link(links, start, j, ids[start]);
+			start = j;
+		}
+	} else if(row < 0 && scrollback != NULL) {
+		/* the first span at or after line, then the rest of that line's */
+		uint32_t lo = 0, hi = scrollback->link_spans_count;
+		while(lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+			if((int64_t)history_link_span(scrollback, mid)->line < line)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for(i = lo; i < scrollback->link_spans_count; i++) {
+			struct link_span *span = history_link_span(scrollback, i);
+			if((int64_t)span->line != line)
+				break;
+			add_row_link(links, span->start, span->end, span->uri);
+		}
+	}
+	detect_urls(cells, links, links->count);
+}
+
+/* run the opener in a grandchild so nothing is left to reap */
+static void open_uri(const char *uri) {
+	pid_t pid = fork();
+	if(pid == 0) {
+		if(fork() == 0) {
+			setsid();
+			execlp(LINK_OPENER, LINK_OPENER, uri, (char *)NULL);
+			_exit(127);
+		}
+		_exit(0);
+	}
+	if(pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+/* window pixel x, y to the cell under it, then to the link found there when
+ * its row was last drawn */
+static void open_link_at(struct session *session, int x, int y) {
+	struct render_data *render_data = &session->render_data;
+	struct texture_data *texture_data = render_data->texture_data;
+	int line_height = cell_height(texture_data);
+	int64_t doc_y = y + render_data->view_px - row_top(texture_data);
+	if(doc_y < 0)
+		return;
+	int64_t line = doc_y / line_height;
+	int col = x / cell_width(texture_data);
+	int slot = line % RING_ROWS;
+	struct row_links *links = &render_data->ring_links[slot];
+	int i, j;
+	if(render_data->ring_line[slot] != line)
+		return;
+	for(i = 0; i < links->count; i++) {
+		struct link_span *span = &links->spans[i];
+		if(col < span->start || col >= span->end)
+			continue;
+		if(span->uri != 0) {
+			open_uri(session->links.uris[span->uri - 1]);
+			return;
+		}
+		int row;
+		const uint32_t *cells = document_line(render_data, line, &row);
+		char url[TERM_WIDTH + 1];
+		if(cells == NULL)
+			return;
+		for(j = span->start; j < span->end; j++)
+			url[j - span->start] = cells[j];
+		url[span->end - span->start] = '\0';
+		open_uri(url);
+		return;
+	}
+}
+
+/* END LINK CODE */
+/* the top row goes to scrollback on the primary screen and is discarded on the
+ * alternate one. rows keep their document line numbers, so their dirty flags
+ * move with them and only the new bottom row has to be rebuilt */
+static void shift_cells_up_displacing_top(struct screen *screen) {
+	screen->term_x=0;
+	if(screen->scrollback)
+		scrollback_push(screen->scrollback, screen->terminal_cells[0]);
+	if(screen->links_used) {
+		if(screen->scrollback)
+			push_link_spans(screen->scrollback, screen->base_line, screen->links[0]);
+		memmove(screen->links[0], screen->links[1], (screen->rows - 1) * sizeof screen->links[0]);
+		memset(screen->links[screen->rows - 1], 0, sizeof screen->links[0]);
+	}
+	if(screen->marks_used) {
+		if(screen->scrollback)
+			push_cell_marks(screen->scrollback, screen->base_line, screen->marks[0]);
+		memmove(screen->marks[0], screen->marks[1], (screen->rows - 1) * sizeof screen->marks[0]);
+		memset(screen->marks[screen->rows - 1], 0, sizeof screen->marks[0]);
+	}
+	screen->base_line++;
+	memmove(screen->terminal_cells[0], screen->terminal_cells[1],
+		(screen->rows - 1) * sizeof screen->terminal_cells[0]);
+	memset(screen->terminal_cells[screen->rows - 1], 0, sizeof screen->terminal_cells[0]);
+	memmove(&screen->dirty[0], &screen->dirty[1], (screen->rows - 1) * sizeof screen->dirty[0]);
+	screen->dirty[screen->rows - 1] = DIRTY_ALL;
+}
+void add_new_line(struct render_data *render_data) {
+	struct screen *screen = render_data->screen;
+	if(screen->term_y < screen->rows-1) {
+		screen->term_x = 0;
+		screen->term_y++;
+	} 
+	else {
+		shift_cells_up_displacing_top(screen);
+		/* a scrolled back viewport stays on the text the user is reading */
+		if(render_data->scroll_lines > 0)
+			scroll_viewport(render_data, 1);
+	}
+}
+
+/* shrinking scrolls rows off the top until the cursor fits, like a newline
+ * at the bottom would; cells outside the new size are cleared */
+static void resize_screen(struct screen *screen, int cols, int rows) {
+	int i;
+	while(screen->term_y >= rows) {
+		int x = screen->term_x;
+		shift_cells_up_displacing_top(screen);
+		screen->term_x = x;
+		screen->term_y--;
+	}
+	for(i = 0; i < TERM_HEIGHT; i++) {
+		if(i >= rows) {
+			memset(screen->terminal_cells[i], 0, sizeof screen->terminal_cells[i]);
+			memset(screen->links[i], 0, sizeof screen->links[i]);
+			memset(screen->marks[i], 0, sizeof screen->marks[i]);
+		} else if(cols < TERM_WIDTH) {
+			memset(screen->terminal_cells[i] + cols, 0,
+				(TERM_WIDTH - cols) * sizeof screen->terminal_cells[i][0]);
+			memset(screen->links[i] + cols, 0,
+				(TERM_WIDTH - cols) * sizeof screen->links[i][0]);
+			memset(screen->marks[i] + cols * CELL_MARKS, 0,
+				(TERM_WIDTH - cols) * CELL_MARKS * sizeof screen->marks[i][0]);
+		}
+	}
+	screen->cols = cols;
+	screen->rows = rows;
+	if(screen->term_x > cols)
+		screen->term_x = cols;
+	if(screen->saved_x > cols)
+		screen->saved_x = cols;
+	if(screen->saved_y >= rows)
+		screen->saved_y = rows - 1;
+	mark_screen_dirty(screen);
+}
+
+/* fit the grid to the window at the current cell size */
+static void resize_grid(struct render_data *render_data) {
+	struct texture_data *texture_data = render_data->texture_data;
+	struct session *session = render_data->session;
+	int cols = session->width / cell_width(texture_data);
+	/* the first baseline sits below a top margin, about a row's worth */
+	int rows = session->height / cell_height(texture_data) - 1;
+	if(cols > TERM_WIDTH)
+		cols = TERM_WIDTH;
+	if(cols < 1)
+		cols = 1;
+	if(rows > TERM_HEIGHT)
+		rows = TERM_HEIGHT;
+	if(rows < 1)
+		rows = 1;
+	if(cols == render_data->primary->cols && rows == render_data->primary->rows)
+		return;
+	resize_screen(render_data->primary, cols, rows);
+	resize_screen(render_data->alternate, cols, rows);
+	invalidate_ring(render_data);
+	scroll_viewport(render_data, 0);
+	if(session->pty.master_fd >= 0)
+		resize_pty(&session->pty, render_data->screen, texture_data);
+}
+
+/* BEGIN GRAPHICS CODE */
+
+/* the kitty graphics protocol: ESC _ G key=value,... ; payload ESC \
+ * pixels come as raw rgb or rgba, either base64 in the escape or, without
+ * any copy through the pty, from shared memory or a file that is mapped. the
+ * texture is made at frame time, a few per frame, so ingest never waits */
+
+static struct image *find_image(struct graphics *graphics, uint32_t id) {
+	int i;
+	for(i = 0; i < IMAGE_MAX; i++) {
+		if(graphics->images[i].id == id && id != 0)
+			return &graphics->images[i];
+	}
+	return NULL;
+}
+
+static void release_image_data(struct image *image) {
+	if(image->mapping)
+		munmap(image->mapping, image->mapping_size);
+	else
+		free(image->data);
+	image->mapping = NULL;
+	image->data = NULL;
+}
+
+static void free_image(struct graphics *graphics, struct image *image) {
+	int i;
+	for(i = 0; i < IMAGE_MAX_PLACEMENTS; i++) {
+		if(graphics->placements[i].image_id == image->id)
+			graphics->placements[i].image_id = 0;
+	}
+	if(graphics->loading == image)
+		graphics->loading = NULL;
+	release_image_data(image);
+	if(image->texture)
+		glDeleteTextures(1, &image->texture);
+	graphics->bytes -= (size_t)image->width * image->height * 4;
+	memset(image, 0, sizeof *image);
+}
+
+/* a slot for an image of the given size, evicting the least recently used
+ * ones while the cache would be over budget */
+static struct image *alloc_image(struct graphics *graphics, uint32_t id, int width, int height) {
+	size_t bytes = (size_t)width * height * 4;
+	struct image *image = find_image(graphics, id);
+	int i;
+	if(image)
+		free_image(graphics, image);
+	for(;;) {
+		struct image *oldest = NULL, *free_slot = NULL;
+		for(i = 0; i < IMAGE_MAX; i++) {
+			struct image *candidate = &graphics->images[i];
+			if(candidate->id == 0) {
+				free_slot = free_slot ? free_slot : candidate;
+				continue;
+			}
+			if(candidate != graphics->loading && (!oldest || candidate->last_used < oldest->last_used))
+				oldest = candidate;
+		}
+		if(free_slot && graphics->bytes + bytes <= IMAGE_CACHE_BYTES) {
+			image = free_slot;
+			break;
+		}
+		if(oldest == NULL)
+			return NULL;
+		free_image(graphics, oldest);
+	}
+	image->id = id;
+	image->width = width;
+	image->height = height;
+	image->last_used = ++graphics->sequence;
+	graphics->bytes += bytes;
+	return image;
+}
+
+/* images sent without an id are numbered down from the top of the range */
+static uint32_t image_id(struct graphics *graphics, struct graphics_command *command) {
+	return command->id ? command->id : UINT32_MAX - (uint32_t)(graphics->sequence & 0x7fffffff);
+}
+
+static void parse_graphics_control(const char *control, int len, struct graphics_command *command) {
+	int i = 0;
+	memset(command, 0, sizeof *command);
+	command->action = 't';
+	command->medium = 'd';
+	command->format = 32;
+	/* control starts with the G that selects graphics */
+	for(i = 1; i < len;) {
+		char key = control[i];
+		char value[32];
+		int n = 0;
+		if(i + 1 >= len || control[i + 1] != '=')
+			return;
+		for(i += 2; i < len && control[i] != ','; i++) {
+			if(n < (int)sizeof value - 1)
+				value[n++] = control[i];
+		}
+		value[n] = '\0';
+		i++;
+		unsigned long number = strtoul(value, NULL, 10);
+		switch(key) {
+		case 'a': command->action = value[0]; break;
+		case 't': command->medium = value[0]; break;
+		case 'f': command->format = number; break;
+		case 's': command->width = number; break;
+		case 'v': command->height = number; break;
+		case 'i': command->id = number; break;
+		case 'c': command->cols = number; break;
+		case 'r': command->rows = number; break;
+		case 'q': command->quiet = number; break;
+		case 'm': command->more = number == 1; break;
+		case 'd': command->delete_what = value[0]; break;
+		case 'O': command->offset = number; break;
+		case 'S': command->size = number; break;
+		}
+	}
+}
+
+static void graphics_reply(struct session *session, const char *message) {
+	struct graphics_command *command = &session->graphics.command;
+	char reply[128];
+	bool ok = strcmp(message, "OK") == 0;
+	if(session->pty.master_fd < 0 || command->id == 0 || command->quiet >= 2
+			|| (ok && command->quiet == 1))
+		return;
+	int len = snprintf(reply, sizeof reply, "\033_Gi=%u;%s\033\\", command->id, message);
+	write(session->pty.master_fd, reply, len);
+}
+
+/* the control data is complete; get ready for the payload */
+static void graphics_begin(struct render_data *render_data) {
+	struct parser *parser = &render_data->parser;
+	struct graphics *graphics = &render_data->session->graphics;
+	struct graphics_command *command = &graphics->command;
+	if(parser->apc_len == 0 || parser->apc[0] != 'G') {
+		command->action = 0;
+		return;
+	}
+	/* further chunks of a direct transfer carry little more than m */
+	if(graphics->loading) {
+		struct graphics_command chunk;
+		parse_graphics_control(parser->apc, parser->apc_len, &chunk);
+		command->more = chunk.more;
+		return;
+	}
+	parse_graphics_control(parser->apc, parser->apc_len, command);
+	graphics->path_len = 0;
+	if(command->action != 't' && command->action != 'T')
+		return;
+	if((command->format != 24 && command->format != 32)
+			|| command->width <= 0 || command->height <= 0
+			|| command->width > IMAGE_MAX_DIMENSION || command->height > IMAGE_MAX_DIMENSION) {
+		graphics_reply(render_data->session, "EINVAL:unsupported format or size");
+		command->action = 0;
+		return;
+	}
+	if(command->medium != 'd')
+		return;
+	struct image *image = alloc_image(graphics, image_id(graphics, command),
+		command->width, command->height);
+	if(image == NULL) {
+		graphics_reply(render_data->session, "ENOSPC:image cache full");
+		command->action = 0;
+		return;
+	}
+	image->format = command->format;
+	image->size = (size_t)command->width * command->height * (command->format / 8);
+	image->data = malloc(image->size);
+	if(image->data == NULL) {
+		free_image(graphics, image);
+		graphics_reply(render_data->session, "ENOMEM:out of memory");
+		command->action = 0;
+		return;
+	}
+	graphics->loading = image;
+}
+
+static void graphics_payload_byte(struct render_data *render_data, char c) {
+	struct parser *parser = &render_data->parser;
+	struct graphics *graphics = &render_data->session->graphics;
+	int value;
+	if(c >= 'A' && c <= 'Z')
+		value = c - 'A';
+	else if(c >= 'a' && c <= 'z')
+		value = c - 'a' + 26;
+	else if(c >= '0' && c <= '9')
+		value = c - '0' + 52;
+	else if(c == '+')
+		value = 62;
+	else if(c == '/')
+		value = 63;
+	else
+		return;
+	parser->base64_bits = parser->base64_bits << 6 | value;
+	parser->base64_count += 6;
+	if(parser->base64_count < 8)
+		return;
+	parser->base64_count -= 8;
+	unsigned char byte = parser->base64_bits >> parser->base64_count;
+	if(graphics->loading) {
+		struct image *image = graphics->loading;
+		if(image->received < image->size)
+			image->data[image->received++] = byte;
+	} else if(graphics->command.action && graphics->path_len < sizeof graphics->path - 1) {
+		graphics->path[graphics->path_len++] = byte;
+	}
+}
+
+/* whether path is dir or lies under it */
+static bool path_under(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+	return strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+/* a temporary file is only deleted from a temporary directory, and only
+ * when its name marks it as made for this protocol */
+static bool may_unlink_image_file(const char *resolved) {
+	const char *tmpdir = getenv("TMPDIR");
+	char *tmpdir_resolved = tmpdir && *tmpdir ? realpath(tmpdir, NULL) : NULL;
+	bool in_tmp = path_under(resolved, "/tmp") || path_under(resolved, "/dev/shm")
+		|| (tmpdir_resolved && path_under(resolved, tmpdir_resolved));
+	free(tmpdir_resolved);
+	return in_tmp && strstr(strrchr(resolved, '/') + 1, "tty-graphics-protocol");
+}
+
+/* map the pixels of a shared memory object or file named by the payload.
+ * files are resolved first, so nothing under /proc, /sys or /dev (bar
+ * /dev/shm) is read, and only regular files are accepted; O_NONBLOCK keeps
+ * a fifo swapped in after the check from stalling the terminal */
+static const char *map_image_file(struct graphics *graphics, struct image *image) {
+	struct graphics_command *command = &graphics->command;
+	struct stat st;
+	int fd;
+	graphics->path[graphics->path_len] = '\0';
+	if(command->medium == 's') {
+		fd = shm_open(graphics->path, O_RDONLY | O_NOFOLLOW, 0);
+	} else {
+		char *resolved = realpath(graphics->path, NULL);
+		if(resolved == NULL)
+			return "EBADF:cannot open image data";
+		if(path_under(resolved, "/proc") || path_under(resolved, "/sys")
+				|| (path_under(resolved, "/dev") && !path_under(resolved, "/dev/shm"))) {
+			free(resolved);
+			return "EPERM:image data path not allowed";
+		}
+		fd = open(resolved, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW);
+		/* the sender hands temporary files over to us */
+		if(fd >= 0 && command->medium == 't' && may_unlink_image_file(resolved))
+			unlink(resolved);
+		free(resolved);
+	}
+	if(fd < 0)
+		return "EBADF:cannot open image data";
+	if(command->medium == 's')
+		shm_unlink(graphics->path);
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return "EINVAL:image data is not a regular file";
+	}
+	size_t size = command->size ? command->size : image->size;
+	if(size < image->size || command->offset + image->size > (size_t)st.st_size) {
+		close(fd);
+		return "EINVAL:image data too short";
+	}
+	/* mmap wants a page aligned offset */
+	size_t skip = command->offset % (size_t)sysconf(_SC_PAGESIZE);
+	void *map = mmap(NULL, image->size + skip, PROT_READ, MAP_SHARED, fd, command->offset - skip);
+	close(fd);
+	if(map == MAP_FAILED)
+		return "EIO:cannot map image data";
+	image->mapping = map;
+	image->mapping_size = image->size + skip;
+	image->data = (unsigned char *)map + skip;
+	image->received = image->size;
+	return NULL;
+}
+
+/* put an image at the cursor and move the cursor past it, as the text it
+ * stands in for would */
+static void place_image(struct render_data *render_data, struct image *image) {
+	struct graphics *graphics = &render_data->session->graphics;
+	struct graphics_command *command = &graphics->command;
+	struct texture_data *texture_data = render_data->texture_data;
+	struct screen *screen = render_data->screen;
+	struct image_placement *placement = NULL;
+	int i;
+	for(i = 0; i < IMAGE_MAX_PLACEMENTS && !placement; i++) {
+		if(graphics->placements[i].image_id == 0)
+			placement = &graphics->placements[i];
+	}
+	if(placement == NULL) {
+		graphics_reply(render_data->session, "ENOSPC:too many placements");
+		return;
+	}
+	placement->image_id = image->id;
+	placement->screen = screen;
+	placement->line = screen->base_line + screen->term_y;
+	placement->col = screen->term_x;
+	placement->width_cells = command->cols ? command->cols
+		: image->width / (float)cell_width(texture_data);
+	placement->height_cells = command->rows ? command->rows
+		: image->height / (float)cell_height(texture_data);
+	placement->cols = placement->width_cells + 0.999f;
+	placement->rows = placement->height_cells + 0.999f;
+	image->last_used = ++graphics->sequence;
+	int x = screen->term_x;
+	for(i = 1; i < placement->rows; i++)
+		add_new_line(render_data);
+	/* a scrolled grid moved the placement up with it */
+	placement->line = screen->base_line + screen->term_y - (placement->rows - 1);
+	screen->term_x = MIN(x + placement->cols, screen->cols);
+	screen->dirty[screen->term_y] = DIRTY_ALL;
+}
+
+static void delete_images(struct graphics *graphics, struct graphics_command *command) {
+	int i;
+	switch(command->delete_what) {
+	case 0:
+	case 'a':
+	case 'A':
+		for(i = 0; i < IMAGE_MAX_PLACEMENTS; i++)
+			graphics->placements[i].image_id = 0;
+		if(command->delete_what == 'A') {
+			for(i = 0; i < IMAGE_MAX; i++) {
+				if(graphics->images[i].id)
+					free_image(graphics, &graphics->images[i]);
+			}
+		}
+		break;
+	case 'i':
+	case 'I':
+		for(i = 0; i < IMAGE_MAX_PLACEMENTS; i++) {
+			if(graphics->placements[i].image_id == command->id)
+				graphics->placements[i].image_id = 0;
+		}
+		if(command->delete_what == 'I' && find_image(graphics, command->id))
+			free_image(graphics, find_image(graphics, command->id));
+		break;
+	}
+}
+
+static void graphics_end(struct render_data *render_data) {
+	struct session *session = render_data->session;
+	struct graphics *graphics = &session->graphics;
+	struct graphics_command *command = &graphics->command;
+	struct image *image;
+	const char *error;
+	switch(command->action) {
+	case 't':
+	case 'T':
+		if(command->medium == 'd') {
+			image = graphics->loading;
+			if(image == NULL || command->more)
+				return;
+			graphics->loading = NULL;
+			if(image->received != image->size) {
+				free_image(graphics, image);
+				graphics_reply(session, "EINVAL:image data size mismatch");
+				return;
+			}
+		} else {
+			if(command->medium != 's' && command->medium != 'f' && command->medium != 't') {
+				graphics_reply(session, "EINVAL:unsupported transmission medium");
+				return;
+			}
+			image = alloc_image(graphics, image_id(graphics, command),
+				command->width, command->height);
+			if(image == NULL) {
+				graphics_reply(session, "ENOSPC:image cache full");
+				return;
+			}
+			image->format = command->format;
+			image->size = (size_t)command->width * command->height * (command->format / 8);
+			if((error = map_image_file(graphics, image)) != NULL) {
+				free_image(graphics, image);
+				graphics_reply(session, error);
+				return;
+			}
+		}
+		if(command->action == 'T')
+			place_image(render_data, image);
+		graphics_reply(session, "OK");
+		/* an image without an id can only ever be shown once */
+		if(command->id == 0 && command->action == 't')
+			free_image(graphics, image);
+		break;
+	case 'p':
+		image = find_image(graphics, command->id);
+		if(image == NULL) {
+			graphics_reply(session, "ENOENT:no such image");
+			return;
+		}
+		place_image(render_data, image);
+		graphics_reply(session, "OK");
+		break;
+	case 'd':
+		delete_images(graphics, command);
+		break;
+	}
+}
+
+static void graphics_abort(struct render_data *render_data) {
+	struct graphics *graphics = &render_data->session->graphics;
+	if(graphics->loading)
+		free_image(graphics, graphics->loading);
+	graphics->command.action = 0;
+}
+
+/* placements that scrolled out of the history go, and with them images
+ * that nothing shows any more */
+static void prune_images(struct render_data *render_data) {
+	struct graphics *graphics = &render_data->session->graphics;
+	struct scrollback *scrollback = render_data->primary->scrollback;
+	int i, j;
+	for(i = 0; i < IMAGE_MAX_PLACEMENTS; i++) {
+		struct image_placement *placement = &graphics->placements[i];
+		if(placement->image_id == 0 || placement->screen != render_data->primary
+				|| placement->line + placement->rows > scrollback->first_line)
+			continue;
+		uint32_t id = placement->image_id;
+		placement->image_id = 0;
+		for(j = 0; j < IMAGE_MAX_PLACEMENTS; j++) {
+			if(graphics->placements[j].image_id == id)
+				break;
+		}
+		if(j == IMAGE_MAX_PLACEMENTS && find_image(graphics, id))
+			free_image(graphics, find_image(graphics, id));
+	}
+}
+
+static void upload_image(struct image *image) {
+	GLenum format = image->format == 24 ? GL_RGB : GL_RGBA;
+	glActiveTexture(GL_TEXTURE0 + GLYPH_PAGE_COLOR);
+	glGenTextures(1, &image->texture);
+	glBindTexture(GL_TEXTURE_2D, image->texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	/* straight from the mapping when the pixels came through shared memory */
+	glTexImage2D(GL_TEXTURE_2D, 0, format, image->width, image->height, 0, format,
+		GL_UNSIGNED_BYTE, image->data);
+	count_metric(&metrics.texture_bytes_uploaded, image->size);
+	release_image_data(image);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/* draw the placements in view over the text, after it in the same pass. the
+ * quads come from client memory; there are only ever a few */
+static void draw_images(struct render_data *render_data, float sx, float sy) {
+	struct graphics *graphics = &render_data->session->graphics;
+	struct opengl_data *gl_data = render_data->gl_data;
+	struct texture_data *texture_data = render_data->texture_data;
+	int line_height = cell_height(texture_data);
+	int width = cell_width(texture_data);
+	int64_t row_offset = row_top(texture_data);
+	int uploads = 0;
+	int i;
+	prune_images(render_data);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUniform4f(gl_data->uniform_transform, sx, sy, 0, 0);
+	glActiveTexture(GL_TEXTURE0 + GLYPH_PAGE_COLOR);
+	for(i = 0; i < IMAGE_MAX_PLACEMENTS; i++) {
+		struct image_placement *placement = &graphics->placements[i];
+		if(placement->image_id == 0 || placement->screen != render_data->screen)
+			continue;
+		int64_t top = (int64_t)placement->line * line_height - render_data->view_px + row_offset;
+		float w = placement->width_cells * width;
+		float h = placement->height_cells * line_height;
+		if(top + h < 0 || top > render_data->session->height)
+			continue;
+		struct image *image = find_image(graphics, placement->image_id);
+		if(image == NULL)
+			continue;
+		if(image->texture == 0) {
+			if(uploads++ >= IMAGE_UPLOADS_PER_FRAME)
+				continue;
+			upload_image(image);
+			glActiveTexture(GL_TEXTURE0 + GLYPH_PAGE_COLOR);
+		}
+		image->last_used = ++graphics->sequence;
+		float x = placement->col * width;
+		float y = top;
+		struct point quad[6] = {
+			{x, y, 0, 0, GLYPH_PAGE_IMAGE},
+			{x + w, y, 1, 0, GLYPH_PAGE_IMAGE},
+			{x, y + h, 0, 1, GLYPH_PAGE_IMAGE},
+			{x + w, y, 1, 0, GLYPH_PAGE_IMAGE},
+			{x, y + h, 0, 1, GLYPH_PAGE_IMAGE},
+			{x + w, y + h, 1, 1, GLYPH_PAGE_IMAGE},
+		};
+		glBindTexture(GL_TEXTURE_2D, image->texture);
+		glVertexAttribPointer(gl_data->attribute_coord, 4, GL_FLOAT, GL_FALSE, sizeof(struct point),
+			&quad[0].surface_x);
+		glVertexAttribPointer(gl_data->attribute_page, 1, GL_FLOAT, GL_FALSE, sizeof(struct point),
+			&quad[0].texture_page);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+static void free_graphics(struct session *session) {
+	struct graphics *graphics = &session->graphics;
+	int i;
+	for(i = 0; i < IMAGE_MAX; i++) {
+		if(graphics->images[i].id)
+			free_image(graphics, &graphics->images[i]);
+	}
+}
+
+/* END GRAPHICS CODE */
+
+/* BEGIN ESCAPE SEQUENCE CODE */
+
+static void clear_screen(struct screen *screen) {
+	memset(screen->terminal_cells, 0, sizeof screen->terminal_cells);
+	memset(screen->links, 0, sizeof screen->links);
+	screen->links_used = false;
+	memset(screen->marks, 0, sizeof screen->marks);
+	screen->marks_used = false;
+	mark_screen_dirty(screen);
+}
+
+static void save_cursor(struct screen *screen) {
+	screen->saved_x = screen->term_x;
+	screen->saved_y = screen->term_y;
+}
+
+static void restore_cursor(struct screen *screen) {
+	screen->term_x = screen->saved_x;
+	screen->term_y = screen->saved_y;
+}
+
+/* switching never copies a grid: the active screen pointer changes and the
+ * renderer is told to rebuild everything from the other buffer */
+static void switch_screen(struct render_data *render_data, struct screen *screen) {
+	if(render_data->screen == screen)
+		return;
+	render_data->screen = screen;
+	mark_screen_dirty(screen);
+	/* both screens number their lines independently, so nothing in the ring
+	 * can be trusted, and the alternate screen has no history to look at */
+	invalidate_ring(render_data);
+	render_data->scroll_lines = 0;
+	render_data->view_px = (int64_t)screen->base_line * cell_height(render_data->texture_data);
+}
+
+static void begin_synchronized_update(struct render_data *render_data) {
+	render_data->synchronized = true;
+	render_data->sync_start_ns = monotonic_ns();
+}
+
+/* called for the end marker and on timeout; draws the frame that was held back */
+static void end_synchronized_update(struct render_data *render_data) {
+	render_data->synchronized = false;
+	if(render_data->frame_deferred) {
+		render_data->frame_deferred = false;
+		render_cells(render_data);
+	}
+}
+
+/* milliseconds until a synchronized update must be forced out, or -1 */
+static int synchronized_update_timeout(struct render_data *render_data) {
+	if(!render_data->synchronized)
+		return -1;
+	uint64_t elapsed_ms = (monotonic_ns() - render_data->sync_start_ns) / 1000000;
+	if(elapsed_ms >= SYNC_TIMEOUT_MS)
+		return 0;
+	return SYNC_TIMEOUT_MS - elapsed_ms;
+}
+
+/* DECRPM value: 1 set, 2 reset, 0 not recognized */
+static int query_private_mode(struct render_data *render_data, int mode) {
+	switch(mode) {
+	case 47:
+	case 1047:
+	case 1049:
+		return render_data->screen == render_data->alternate ? 1 : 2;
+	case 2026:
+		return render_data->synchronized ? 1 : 2;
+	default:
+		return 0;
+	}
 }
 
-/* we should no longer create a monospaced texture */
-void create_texture(struct freetype_data *ft_data, struct opengl_data *gl_data, struct texture_data *texture_data, struct glyph *glyphs) {
-	ft_data->g = ft_data->face->glyph;
-	glActiveTexture(GL_TEXTURE0);
-	/* store one texture name in texture param */
-	glGenTextures(1,&gl_data->texture);
-	/* create or use named texture */
-	/* from this point on, GL_TEXTURE_2D becomes an alias for texture */
-	glBindTexture(GL_TEXTURE_2D,gl_data->texture);
-	glUniform1i(gl_data->uniform_text, 0);
-	/* when pixels are read from client memory, require byte alignment */
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	int i;
-	int offset_x = 0;
-	printf("max advance from size: %hd\n",ft_data->g->face->max_advance_width);
-	for(i=32; i < 128; i++) {
-		if(FT_Load_Char(ft_data->face,i,FT_LOAD_RENDER)) {
-			fprintf(stderr, "Loading character %c failed.\n",i);
-			continue;
+static void set_private_mode(struct render_data *render_data, int mode, bool set) {
+	switch(mode) {
+	case 47:
+		switch_screen(render_data, set ? render_data->alternate : render_data->primary);
+		break;
+	case 1047:
+		if(set) {
+			switch_screen(render_data, render_data->alternate);
+		} else {
+			if(render_data->screen == render_data->alternate)
+				clear_screen(render_data->alternate);
+			switch_screen(render_data, render_data->primary);
 		}
-		texture_data->texture_width += ft_data->g->bitmap.width + 1;
-		texture_data->max_char_width = MAX(ft_data->g->bitmap.width,texture_data->max_char_width);
-		texture_data->max_char_height = MAX(ft_data->g->bitmap.rows,texture_data->max_char_height);
-	}
-	texture_data->texture_height = texture_data->max_char_height;
-	/*
-	 * Allow elements of image array to be read by shaders
-	 * Data is read from bitmap.buffer as sequence of unsigned bytes
-	 * and grouped into sets of one value to form elements
-	 * */
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, texture_data->texture_width, texture_data->texture_height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, ft_data->g->bitmap.buffer);
-	for(i=32; i < 128; i++) {
-		if(FT_Load_Char(ft_data->face,i,FT_LOAD_RENDER)) {
-			fprintf(stderr, "Loading character %c failed.\n",i);
-			continue;
+		break;
+	case 1048:
+		if(set)
+			save_cursor(render_data->screen);
+		else
+			restore_cursor(render_data->screen);
+		break;
+	case 1049:
+		if(set) {
+			if(render_data->screen == render_data->alternate)
+				break;
+			save_cursor(render_data->primary);
+			clear_screen(render_data->alternate);
+			switch_screen(render_data, render_data->alternate);
+		} else {
+			if(render_data->screen == render_data->primary)
+				break;
+			switch_screen(render_data, render_data->primary);
+			restore_cursor(render_data->primary);
 		}
-		 /* redefine contiguous subregion of array texture image */
-		glTexSubImage2D(GL_TEXTURE_2D, 0, offset_x, 0, ft_data->g->bitmap.width, ft_data->g->bitmap.rows, GL_ALPHA, GL_UNSIGNED_BYTE, ft_data->g->bitmap.buffer);
-		glyphs[i] = (struct glyph) {
-			offset_x / (float)texture_data->texture_width,
-			0,
-			ft_data->g->advance.x >> 6,
-			ft_data->g->advance.y >> 6,
-			ft_data->g->bitmap.width,
-			ft_data->g->bitmap.rows,
-			ft_data->g->bitmap_top,
-			ft_data->g->bitmap_left
-		};
-		offset_x += ft_data->g->bitmap.width + 1;
+		break;
+	case 2026:
+		if(set)
+			begin_synchronized_update(render_data);
+		else if(render_data->synchronized)
+			end_synchronized_update(render_data);
+		break;
 	}
 }
 
-void init_terminal_cells(char terminal_cells[25][80]) {
-	int i,j;
-	for(i=0;i<25;i++) {
-		for(j=0;j<80;j++) {
-			terminal_cells[i][j]=0;
-		}
+static void dispatch_csi(struct render_data *render_data, char final) {
+	struct parser *parser = &render_data->parser;
+	int i;
+	if(!parser->private_marker)
+		return;
+	/* DECRQM, lets applications probe for synchronized output */
+	if(final == 'p' && parser->intermediate == '$' && parser->nparams > 0) {
+		char reply[32];
+		int mode = parser->params[0];
+		int len = snprintf(reply, sizeof reply, "\033[?%d;%d$y",
+			mode, query_private_mode(render_data, mode));
+		if(render_data->session->pty.master_fd >= 0)
+			write(render_data->session->pty.master_fd, reply, len);
+		return;
 	}
+	if(parser->intermediate != 0 || (final != 'h' && final != 'l'))
+		return;
+	for(i = 0; i < parser->nparams; i++)
+		set_private_mode(render_data, parser->params[i], final == 'h');
 }
 
-void init_gl_stuff(struct freetype_data *ft_data, struct opengl_data *gl_data, struct texture_data *texture_data) {
-	const char * filename =
-		"/usr/share/fonts/TTF/Inconsolata-Regular.ttf";
-	ft_data->status = FT_Init_FreeType (& ft_data->value);
-    if (ft_data->status != 0) {
-		fprintf (stderr, "Error %d opening library.\n", ft_data->status);
-		exit (EXIT_FAILURE);
-    }
-    ft_data->status = FT_New_Face (ft_data->value, filename, 0, & ft_data->face);
-    if (ft_data->status != 0) {
-		fprintf (stderr, "Error %d opening %s.\n", ft_data->status, filename);
-		exit (EXIT_FAILURE);
-    }
-	gl_text_prog = compile_text_program();
-	if(gl_text_prog == 0) {
-		fprintf(stderr, "failed to compile shader program\n");
+/* returns true when the byte was consumed by an escape sequence */
+static bool parse_escape_byte(struct render_data *render_data, char c) {
+	struct parser *parser = &render_data->parser;
+	switch(parser->state) {
+	case PARSER_GROUND:
+		if(c != '\033')
+			return false;
+		parser->state = PARSER_ESCAPE;
+		return true;
+	case PARSER_ESCAPE:
+		parser->state = PARSER_GROUND;
+		switch(c) {
+		case '[':
+			parser->state = PARSER_CSI;
+			parser->private_marker = false;
+			parser->intermediate = 0;
+			parser->nparams = 0;
+			memset(parser->params, 0, sizeof parser->params);
+			break;
+		case '7':
+			save_cursor(render_data->screen);
+			break;
+		case '8':
+			restore_cursor(render_data->screen);
+			break;
+		case ']':
+			parser->state = PARSER_OSC;
+			parser->osc_len = 0;
+			break;
+		case '_':
+			parser->state = PARSER_APC;
+			parser->apc_len = 0;
+			parser->apc_payload = false;
+			parser->base64_bits = 0;
+			parser->base64_count = 0;
+			break;
+		}
+		return true;
+	case PARSER_CSI:
+		if(c == '?' && parser->nparams == 0) {
+			parser->private_marker = true;
+		} else if(c >= '0' && c <= '9') {
+			if(parser->nparams == 0)
+				parser->nparams = 1;
+			int *param = &parser->params[parser->nparams - 1];
+			*param = *param * 10 + (c - '0');
+		} else if(c == ';') {
+			if(parser->nparams == 0)
+				parser->nparams = 1;
+			if(parser->nparams < PARSER_MAX_PARAMS)
+				parser->nparams++;
+		} else if(c >= 0x20 && c <= 0x2f) {
+			parser->intermediate = c;
+		} else if(c >= 0x40 && c <= 0x7e) {
+			dispatch_csi(render_data, c);
+			parser->state = PARSER_GROUND;
+		}
+		return true;
+	case PARSER_APC:
+		if(c == '\033') {
+			parser->state = PARSER_APC_ESCAPE;
+		} else if(parser->apc_payload) {
+			graphics_payload_byte(render_data, c);
+		} else if(c == ';') {
+			parser->apc_payload = true;
+			graphics_begin(render_data);
+		} else if(parser->apc_len < GRAPHICS_CONTROL_MAX) {
+			parser->apc[parser->apc_len++] = c;
+		}
+		return true;
+	case PARSER_OSC:
+		if(c == '\a') {
+			dispatch_osc(render_data);
+			parser->state = PARSER_GROUND;
+		} else if(c == '\033') {
+			parser->state = PARSER_OSC_ESCAPE;
+		} else if(parser->osc_len < (int)sizeof parser->osc - 1) {
+			parser->osc[parser->osc_len++] = c;
+		}
+		return true;
+	case PARSER_OSC_ESCAPE:
+		parser->state = PARSER_GROUND;
+		if(c == '\\')
+			dispatch_osc(render_data);
+		return true;
+	case PARSER_APC_ESCAPE:
+		/* ESC \ ends the command; anything else abandons it */
+		parser->state = PARSER_GROUND;
+		if(c == '\\') {
+			if(!parser->apc_payload)
+				graphics_begin(render_data);
+			graphics_end(render_data);
+		} else {
+			graphics_abort(render_data);
+		}
+		return true;
 	}
-	gl_data->attribute_coord = glGetAttribLocation(gl_text_prog, "coord");
-	gl_data->uniform_text = glGetUniformLocation(gl_text_prog, "text");
-	gl_data->uniform_color = glGetUniformLocation(gl_text_prog, "color");
-	if(gl_data->attribute_coord == -1 || gl_data->uniform_text == -1 || gl_data->uniform_color == -1)
-		fprintf(stderr,"failed to get shader attr or uniform\n");
-	glGenBuffers(1,&gl_data->vbo);
-	FT_Set_Pixel_Sizes(ft_data->face, 0, 24);
-    texture_data->texture_width = 0;
-	texture_data->texture_height = 0;
-	texture_data->max_char_height = 0;
-	texture_data->max_char_width = 0;
+	return false;
 }
 
-// Wayland Client Methods
+/* END ESCAPE SEQUENCE CODE */
 
-int display_connect(struct display *display) {
-	display->wl_display = wl_display_connect(NULL);
-	display->compositor = NULL;
-	display->xdg_wm_base = NULL;
-	display->wl_surface = NULL;
-	display->xdg_surface = NULL;
-	display->xdg_toplevel = NULL;
-	display->egl_window = NULL;
-	display->egl_display = EGL_NO_DISPLAY;
-	display->egl_context = EGL_NO_CONTEXT;
-	display->egl_surface = EGL_NO_SURFACE;
-	display->context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	if (display->wl_display == NULL) {
-		fprintf(stderr, "failed to create display\n");
-		return 1;
+/* feed one byte of a multibyte utf-8 sequence; true once a codepoint is
+ * complete. malformed input comes out as U+FFFD */
+static bool decode_utf8(struct parser *parser, unsigned char byte, uint32_t *codepoint) {
+	if(byte >= 0xf8) {
+		parser->utf8_remaining = 0;
+		*codepoint = 0xfffd;
+		return true;
 	}
-   	display->egl_display = eglGetDisplay((EGLNativeDisplayType)display->wl_display);
-	if(!display->context) {
-        fprintf(stderr, "Couldn't create xkb context\n");
-		return 1;
-    }
-	return 0;
+	if(byte >= 0xc0) {
+		parser->utf8_remaining = byte >= 0xf0 ? 3 : byte >= 0xe0 ? 2 : 1;
+		parser->utf8_codepoint = byte & (0x3f >> parser->utf8_remaining);
+		return false;
+	}
+	if(parser->utf8_remaining == 0) {
+		*codepoint = 0xfffd;
+		return true;
+	}
+	parser->utf8_codepoint = parser->utf8_codepoint << 6 | (byte & 0x3f);
+	if(--parser->utf8_remaining > 0)
+		return false;
+	*codepoint = parser->utf8_codepoint;
+	return true;
 }
 
-void display_disconnect(struct display *display) {
-	if(display->xdg_toplevel)
-		xdg_toplevel_destroy(display->xdg_toplevel);
-	if(display->xdg_surface)
-		xdg_surface_destroy(display->xdg_surface);
-	if(display->wl_surface)
-		wl_surface_destroy(display->wl_surface);
-	if(display->compositor)
-		wl_compositor_destroy(display->compositor);
-	xkb_context_unref(display->context);
-	wl_display_disconnect(display->wl_display);
+/* east asian wide and emoji presentation ranges, which take two cells */
+static bool is_wide(uint32_t codepoint) {
+	return (codepoint >= 0x1100 && codepoint <= 0x115f)
+		|| (codepoint >= 0x2e80 && codepoint <= 0xa4cf)
+		|| (codepoint >= 0xac00 && codepoint <= 0xd7a3)
+		|| (codepoint >= 0xf900 && codepoint <= 0xfaff)
+		|| (codepoint >= 0xfe30 && codepoint <= 0xfe4f)
+		|| (codepoint >= 0xff00 && codepoint <= 0xff60)
+		|| (codepoint >= 0xffe0 && codepoint <= 0xffe6)
+		|| (codepoint >= 0x1f300 && codepoint <= 0x1f64f)
+		|| (codepoint >= 0x1f900 && codepoint <= 0x1f9ff)
+		|| (codepoint >= 0x1fa70 && codepoint <= 0x1faff)
+		|| (codepoint >= 0x20000 && codepoint <= 0x3fffd);
 }
 
-/* TODO: rename this */
-int wl_initialize_compositor(struct wl_registry *registry, struct display *display) {
-	wl_registry_add_listener(registry, &registry_listener, display);
-	wl_display_dispatch(display->wl_display);
-	wl_display_roundtrip(display->wl_display);
-	if (display->compositor == NULL || display->xdg_wm_base == NULL) {
-		fprintf(stderr, "no wl_shm, wl_compositor or xdg_wm_base support\n");
-		return 1;
+/* combining marks (general category Mn) in the common blocks, and the zero
+ * width joiners and variation selectors; none of them move the cursor */
+static bool is_zero_width(uint32_t codepoint) {
+	return (codepoint >= 0x0300 && codepoint <= 0x036f)
+		|| (codepoint >= 0x0483 && codepoint <= 0x0489)
+		|| (codepoint >= 0x0591 && codepoint <= 0x05bd)
+		|| (codepoint >= 0x0610 && codepoint <= 0x061a)
+		|| (codepoint >= 0x064b && codepoint <= 0x065f)
+		|| codepoint == 0x0670
+		|| (codepoint >= 0x06d6 && codepoint <= 0x06dc)
+		|| (codepoint >= 0x06df && codepoint <= 0x06e4)
+		|| codepoint == 0x0e31
+		|| (codepoint >= 0x0e34 && codepoint <= 0x0e3a)
+		|| (codepoint >= 0x0e47 && codepoint <= 0x0e4e)
+		|| (codepoint >= 0x1ab0 && codepoint <= 0x1aff)
+		|| (codepoint >= 0x1dc0 && codepoint <= 0x1dff)
+		|| (codepoint >= 0x200b && codepoint <= 0x200d)
+		|| (codepoint >= 0x20d0 && codepoint <= 0x20ff)
+		|| (codepoint >= 0xfe00 && codepoint <= 0xfe0f)
+		|| (codepoint >= 0xfe20 && codepoint <= 0xfe2f);
+}
+
+/* a zero width codepoint goes with the cell before the cursor, or the wide
+ * glyph that cell is the right half of. with nothing before it on the line
+ * it is dropped */
+static void put_mark(struct screen *screen, uint32_t codepoint) {
+	int x = screen->term_x - 1;
+	int k;
+	if(x < 0)
+		return;
+	if(x > 0 && screen->terminal_cells[screen->term_y][x] == 0
+			&& is_wide(screen->terminal_cells[screen->term_y][x - 1]))
+		x--;
+	uint32_t *marks = &screen->marks[screen->term_y][x * CELL_MARKS];
+	for(k = 0; k < CELL_MARKS && marks[k] != 0; k++)
+		;
+	if(k == CELL_MARKS)
+		return;
+	marks[k] = codepoint;
+	screen->marks_used = true;
+	screen->dirty[screen->term_y] = DIRTY_ALL;
+}
+
+static void put_codepoint(struct render_data *render_data, uint32_t codepoint) {
+	struct screen *screen = render_data->screen;
+	int cells = is_wide(codepoint) ? 2 : 1;
+	if(is_zero_width(codepoint)) {
+		put_mark(screen, codepoint);
+		return;
 	}
-	return 0;
+	if(screen->term_x + cells > screen->cols) {
+		add_new_line(render_data);
+	}
+	/* a new glyph replaces the marks on the cells it takes */
+	if(screen->marks_used)
+		memset(&screen->marks[screen->term_y][screen->term_x * CELL_MARKS], 0,
+			cells * CELL_MARKS * sizeof screen->marks[0][0]);
+	screen->terminal_cells[screen->term_y][screen->term_x] = codepoint;
+	screen->links[screen->term_y][screen->term_x] = render_data->parser.link;
+	/* the right half of a wide glyph stays empty; the glyph covers it */
+	if(cells == 2) {
+		screen->terminal_cells[screen->term_y][screen->term_x + 1] = 0;
+		screen->links[screen->term_y][screen->term_x + 1] = render_data->parser.link;
+	}
+	if(render_data->parser.link)
+		screen->links_used = true;
+	screen->dirty[screen->term_y] = DIRTY_ALL;
+	screen->term_x += cells;
 }
 
-/* TODO: rename */
-int wl_initialize_egl(struct display *display, struct egl *egl) {
-	 if (!eglInitialize(display->egl_display, egl->major, egl->minor)) {
-		fprintf(stderr, "failed to initialize EGL\n");
-		return 1;
+static int process_shell_byte(struct render_data *render_data, char c) {
+	struct parser *parser = &render_data->parser;
+	unsigned char byte = c;
+	uint32_t codepoint;
+	if(byte >= 0x80 && parser->state == PARSER_GROUND) {
+		if(decode_utf8(parser, byte, &codepoint))
+			put_codepoint(render_data, codepoint);
+		return 0;
 	}
-	 	display->egl_display = eglGetDisplay((EGLNativeDisplayType)display->wl_display);
-	if (display->egl_display == EGL_NO_DISPLAY) {
-		fprintf(stderr, "failed to create EGL display\n");
-		return 1;
+	/* anything else cuts a utf-8 sequence short */
+	parser->utf8_remaining = 0;
+	if(parse_escape_byte(render_data, c)) {
+		return 0;
 	}
-		eglChooseConfig(display->egl_display, egl->config_attribs, &egl->egl_config, 1, egl->n);
-	if (egl->n == 0) {
-		fprintf(stderr, "failed to choose an EGL config\n");
-		return 1;
+	if(c == '\r' || c == '\n') {
+		add_new_line(render_data);
+		return 0;
 	}
-	
-	display->egl_context = eglCreateContext(display->egl_display, egl->egl_config,
-		EGL_NO_CONTEXT, egl->context_attribs);
-	if (display->egl_context == EGL_NO_CONTEXT) {
-		fprintf(stderr, "eglCreateContext failed\n");
-		return 1;
+	if(byte < 32) {
+		fprintf(stdout,"invalid codepoint: %d",c);
+		return -1;
 	}
+	put_codepoint(render_data, byte);
 	return 0;
 }
 
-/* TODO: rename */
-int wl_init_surface(struct display *display) {
-	display->wl_surface = wl_compositor_create_surface(display->compositor);
-	display->xdg_surface = xdg_wm_base_get_xdg_surface(display->xdg_wm_base, display->wl_surface);
-	display->xdg_toplevel = xdg_surface_get_toplevel(display->xdg_surface);
-	xdg_surface_add_listener(display->xdg_surface, &xdg_surface_listener, NULL);
-	xdg_toplevel_add_listener(display->xdg_toplevel, &xdg_toplevel_listener, NULL);
-	return 0;
+static void process_shell_output(struct render_data *render_data, const char *buf, size_t len) {
+	size_t i;
+	for(i = 0; i < len; i++)
+		process_shell_byte(render_data, buf[i]);
 }
 
-int more_egl_init(struct display *display, struct egl *egl) {
-	display->egl_window = wl_egl_window_create(display->wl_surface, width, height);
-	if (display->egl_window == NULL) {
-		fprintf(stderr, "wl_egl_window_create failed\n");
+/* BEGIN RECORD REPLAY CODE */
+
+static void write_varint(FILE *file, uint64_t value) {
+	do {
+		unsigned char byte = value & 0x7f;
+		value >>= 7;
+		if(value)
+			byte |= 0x80;
+		fputc(byte, file);
+	} while(value);
+}
+
+/* returns false on a truncated varint */
+static bool read_varint(struct replay *replay, uint64_t *value) {
+	int shift = 0;
+	*value = 0;
+	while(replay->pos < replay->size && shift < 64) {
+		unsigned char byte = replay->data[replay->pos++];
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+		shift += 7;
+	}
+	return false;
+}
+
+int open_recording(struct recording *recording, const char *path) {
+	/* close on exec, so the shell never holds the recording open */
+	recording->file = fopen(path, "wbe");
+	if(recording->file == NULL) {
+		fprintf(stderr,"failed to open %s: %s\n", path, strerror(errno));
 		return 1;
 	}
-	display->egl_surface = eglCreateWindowSurface(display->egl_display, egl->egl_config,
-		(EGLNativeWindowType)display->egl_window, NULL);
-	if (display->egl_surface == EGL_NO_SURFACE) {
-		fprintf(stderr, "eglCreateWindowSurface failed\n");
+	fwrite(RECORDING_MAGIC, 1, strlen(RECORDING_MAGIC), recording->file);
+	recording->last_ns = monotonic_ns();
+	return 0;
+}
+
+static void record_chunk(struct recording *recording, const char *buf, size_t len) {
+	uint64_t now = monotonic_ns();
+	write_varint(recording->file, (now - recording->last_ns) / 1000);
+	write_varint(recording->file, len);
+	fwrite(buf, 1, len, recording->file);
+	recording->last_ns = now;
+}
+
+void close_recording(struct recording *recording) {
+	if(fclose(recording->file) != 0)
+		fprintf(stderr,"failed to write recording: %s\n", strerror(errno));
+}
+
+int open_replay(struct replay *replay, const char *path) {
+	struct stat st;
+	size_t magic_len = strlen(RECORDING_MAGIC);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr,"failed to open %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
 		return 1;
 	}
-	if (!eglMakeCurrent(display->egl_display, display->egl_surface, display->egl_surface, display->egl_context)) {
-		fprintf(stderr, "eglMakeCurrent failed\n");
+	replay->size = st.st_size;
+	replay->data = replay->size ? mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(replay->data == MAP_FAILED || replay->size < magic_len
+			|| memcmp(replay->data, RECORDING_MAGIC, magic_len) != 0) {
+		fprintf(stderr,"%s is not a recording\n", path);
 		return 1;
 	}
-	eglSwapInterval(display->egl_display, 0);
+	replay->pos = magic_len;
+	replay->start_ns = monotonic_ns();
+	replay->due_ns = 0;
+	replay->done = false;
+	replay->bytes = 0;
+	replay->reads = 0;
+	replay->parse_ns = 0;
 	return 0;
 }
-static void shift_cells_up_displacing_top(struct render_data *render_data) {
-	render_data->term_x=0;
-	int i,j;
-	for(i=0;i<24;i++) {
-		for(j=0;j<80;j++) {
-			(*(render_data->terminal_cells))[i][j] = (*(render_data->terminal_cells))[i+1][j];
-		}
-	}
-	for(j=0;j<80;j++) {
-		(*(render_data->terminal_cells))[24][j] = 0; 
-	}
 
+/* poll timeout until the next record should be fed */
+static int replay_timeout(struct replay *replay) {
+	if(replay->done)
+		return -1;
+	if(!replay->realtime)
+		return 0;
+	uint64_t elapsed = monotonic_ns() - replay->start_ns;
+	if(elapsed >= replay->due_ns)
+		return 0;
+	return (replay->due_ns - elapsed) / 1000000 + 1;
+}
+
+static void report_replay(struct render_data *render_data, struct replay *replay) {
+	double elapsed_ms = (monotonic_ns() - replay->start_ns) / 1e6;
+	double parse_ms = replay->parse_ns / 1e6;
+	fprintf(stderr,"replay: %zu bytes in %zu reads, %.1f ms total, %.1f ms parsing (%.1f MB/s)\n",
+		replay->bytes, replay->reads, elapsed_ms, parse_ms,
+		parse_ms > 0 ? replay->bytes / parse_ms / 1e3 : 0);
+	fprintf(stderr,"replay: %llu frames, mean %.2f ms, max %.2f ms\n",
+		(unsigned long long)render_data->frames_rendered,
+		render_data->frames_rendered ? render_data->frame_ns_total / 1e6 / render_data->frames_rendered : 0,
+		render_data->frame_ns_max / 1e6);
 }
-void add_new_line(struct render_data *render_data) {
-	if(render_data->term_y < TERM_HEIGHT-1) {
-		render_data->term_x = 0;
-		render_data->term_y++;
-	} 
-	else {
-		shift_cells_up_displacing_top(render_data);
+
+/* feed the records that are due: in realtime mode those whose original
+ * timestamp has passed, otherwise as many as fit in REPLAY_SLICE_NS */
+static void replay_step(struct render_data *render_data, struct replay *replay) {
+	uint64_t slice_start = monotonic_ns();
+	while(!replay->done) {
+		uint64_t now = monotonic_ns();
+		size_t saved_pos = replay->pos;
+		uint64_t delay_us, len;
+		if(replay->pos == replay->size) {
+			replay->done = true;
+			report_replay(render_data, replay);
+			running = false;
+			break;
+		}
+		if(!read_varint(replay, &delay_us) || !read_varint(replay, &len)
+				|| len > replay->size - replay->pos) {
+			fprintf(stderr,"replay: truncated record at offset %zu\n", saved_pos);
+			replay->pos = replay->size;
+			continue;
+		}
+		if(replay->realtime) {
+			if(now - replay->start_ns < replay->due_ns + delay_us * 1000) {
+				replay->pos = saved_pos;
+				break;
+			}
+			replay->due_ns += delay_us * 1000;
+		} else if(now - slice_start >= REPLAY_SLICE_NS) {
+			replay->pos = saved_pos;
+			break;
+		}
+		uint64_t parse_start = monotonic_ns();
+		process_shell_output(render_data, (const char *)replay->data + replay->pos, len);
+		replay->parse_ns += monotonic_ns() - parse_start;
+		replay->pos += len;
+		replay->bytes += len;
+		replay->reads++;
 	}
 }
+
+/* END RECORD REPLAY CODE */
+
 int read_shell_input(int fd, struct render_data *render_data) {
-	char buf[1];
-	if(read(fd,buf,1) <= 0) {
+	char buf[READ_BUFFER_SIZE];
+	ssize_t len = read(fd,buf,sizeof buf);
+	if(len <= 0) {
 		fprintf(stderr,"failed to read codepoint");
 		return -1;
 	}
-	fprintf(stdout,"read: %d",buf[0]);
-	if(buf[0] == '\r' || buf[0] == '\n') {
-		add_new_line(render_data);
-		return 0;
+	if(render_data->recording)
+		record_chunk(render_data->recording, buf, len);
+	uint64_t parse_start = monotonic_ns();
+	process_shell_output(render_data, buf, len);
+	startup_mark(STARTUP_FIRST_PROMPT);
+	count_metric(&metrics.pty_bytes, len);
+	count_metric(&metrics.pty_reads, 1);
+	record_histogram(&metrics.parse_ns, monotonic_ns() - parse_start);
+	return 0;
+}
+
+/* BEGIN METRICS CODE */
+
+static void write_counter(FILE *out, const char *name, _Atomic uint64_t *counter) {
+	fprintf(out, "# TYPE gl_text_%s counter\ngl_text_%s %llu\n", name, name,
+		(unsigned long long)atomic_load_explicit(counter, memory_order_relaxed));
+}
+
+static void write_gauge(FILE *out, const char *name, uint64_t value) {
+	fprintf(out, "# TYPE gl_text_%s gauge\ngl_text_%s %llu\n", name, name,
+		(unsigned long long)value);
+}
+
+/* cumulative buckets in the prometheus text format */
+static void write_histogram(FILE *out, const char *name, struct histogram *histogram) {
+	uint64_t total = 0;
+	int b;
+	fprintf(out, "# TYPE gl_text_%s histogram\n", name);
+	for(b = 0; b < METRICS_BUCKETS - 1; b++) {
+		total += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+		fprintf(out, "gl_text_%s_bucket{le=\"%llu\"} %llu\n", name,
+			(unsigned long long)(((uint64_t)1 << b) - 1), (unsigned long long)total);
+	}
+	total += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+	fprintf(out, "gl_text_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+	fprintf(out, "gl_text_%s_sum %llu\ngl_text_%s_count %llu\n",
+		name, (unsigned long long)atomic_load_explicit(&histogram->sum, memory_order_relaxed),
+		name, (unsigned long long)atomic_load_explicit(&histogram->count, memory_order_relaxed));
+}
+
+static void write_metrics(FILE *out, struct display *display) {
+	struct glyph_cache *cache = &display->glyph_cache;
+	struct session *session;
+	uint64_t scrollback_bytes = 0, sessions = 0;
+	int i;
+	wl_list_for_each(session, &display->sessions, link) {
+		sessions++;
+		for(i = 0; i < SCROLLBACK_MAX_PAGES; i++) {
+			if(session->scrollback.pages[i])
+				scrollback_bytes += sizeof *session->scrollback.pages[i];
+		}
 	}
-	if(buf[0] < 32) {
-		fprintf(stdout,"invalid codepoint: %d",buf[0]);
+	write_counter(out, "pty_bytes_total", &metrics.pty_bytes);
+	write_counter(out, "pty_reads_total", &metrics.pty_reads);
+	write_histogram(out, "parse_ns", &metrics.parse_ns);
+	write_counter(out, "frames_rendered_total", &metrics.frames_rendered);
+	write_counter(out, "frames_skipped_total", &metrics.frames_skipped);
+	write_histogram(out, "frame_ns", &metrics.frame_ns);
+	write_counter(out, "vertices_uploaded_total", &metrics.vertices_uploaded);
+	write_histogram(out, "vertex_bytes_per_frame", &metrics.vertex_bytes_per_frame);
+	write_counter(out, "texture_bytes_uploaded_total", &metrics.texture_bytes_uploaded);
+	write_counter(out, "rows_shaped_total", &metrics.rows_shaped);
+	write_counter(out, "shape_cache_hits_total", &metrics.shape_cache_hits);
+	write_histogram(out, "atlas_build_ns", &metrics.atlas_build_ns);
+	write_counter(out, "wakeups_total", &metrics.wakeups);
+	write_gauge(out, "sessions", sessions);
+	write_gauge(out, "scrollback_bytes", scrollback_bytes);
+	write_gauge(out, "atlas_bytes",
+		(uint64_t)display->texture_data->texture_width * display->texture_data->texture_height);
+	write_gauge(out, "glyph_cache_entries", cache->count);
+	write_gauge(out, "glyph_cache_capacity", GLYPH_CACHE_SIZE);
+	/* pages fill top down, so the shelf position is how full they are */
+	write_gauge(out, "glyph_page_alpha_rows_used",
+		cache->pages[GLYPH_PAGE_ALPHA - 1].shelf_y + cache->pages[GLYPH_PAGE_ALPHA - 1].shelf_height);
+	write_gauge(out, "glyph_page_color_rows_used",
+		cache->pages[GLYPH_PAGE_COLOR - 1].shelf_y + cache->pages[GLYPH_PAGE_COLOR - 1].shelf_height);
+	write_gauge(out, "glyph_page_rows", GLYPH_PAGE_SIZE);
+	/* 0 until reached */
+	write_gauge(out, "startup_first_frame_ns", startup.phase_ns[STARTUP_FIRST_FRAME]);
+	write_gauge(out, "startup_first_prompt_ns", startup.phase_ns[STARTUP_FIRST_PROMPT]);
+}
+
+static bool metrics_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	return snprintf(addr->sun_path, sizeof addr->sun_path, "%s", path) < (int)sizeof addr->sun_path;
+}
+
+/* listen on path; -1 if the socket cannot be made, which only loses metrics */
+static int open_metrics_socket(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+	if(!metrics_address(&addr, path))
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 4) < 0) {
+		fprintf(stderr,"metrics: cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
 		return -1;
 	}
-	(*(render_data->terminal_cells))[render_data->term_y][render_data->term_x] = buf[0];
-	if(buf[0] >= 32) {
-		if(render_data->term_x == TERM_WIDTH && render_data->term_y < TERM_HEIGHT) {
-			add_new_line(render_data);
+	return fd;
+}
+
+/* each connection gets one snapshot and is closed. the socket does not
+ * block, so a client that stops reading before the snapshot fits the
+ * socket buffer is dropped instead of stalling the terminal */
+static void serve_metrics(int listen_fd, struct display *display) {
+	int fd;
+	while((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		char *text = NULL;
+		size_t len = 0, written = 0;
+		FILE *out;
+		if(fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+			close(fd);
+			continue;
 		}
-		else if (render_data->term_x < 80) {
-			render_data->term_x++;
+		out = open_memstream(&text, &len);
+		if(out) {
+			write_metrics(out, display);
+			fclose(out);
+			while(written < len) {
+				/* MSG_NOSIGNAL: a client gone early must not raise SIGPIPE */
+				ssize_t n = send(fd, text + written, len - written, MSG_NOSIGNAL);
+				if(n < 0 && errno == EINTR)
+					continue;
+				if(n <= 0) {
+					fprintf(stderr,"metrics: dropped a client after %zu of %zu bytes\n", written, len);
+					break;
+				}
+				written += n;
+			}
+			free(text);
 		}
-		return 0;
+		close(fd);
 	}
-	fprintf(stdout,"invalid codepoint: %d",buf[0]);
-	return -1;
 }
 
+/* the stand-in client: print one snapshot from a running terminal */
+static int read_metrics(const char *path) {
+	struct sockaddr_un addr;
+	char buf[READ_BUFFER_SIZE];
+	ssize_t len;
+	int fd;
+	if(!metrics_address(&addr, path)) {
+		fprintf(stderr,"metrics: socket path too long\n");
+		return 1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		fprintf(stderr,"metrics: cannot connect to %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return 1;
+	}
+	while((len = read(fd, buf, sizeof buf)) > 0)
+		fwrite(buf, 1, len, stdout);
+	close(fd);
+	return 0;
+}
+
+/* END METRICS CODE */
+
 void init_egl_struct (struct egl *egl) {
-	EGLint major = 0, minor = 0, n = 0;
-	EGLint config_attribs[] = {
+	static const EGLint config_attribs[] = {
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
 		EGL_RED_SIZE, 1,
 		EGL_GREEN_SIZE, 1,
@@ -943,65 +5294,196 @@ void init_egl_struct (struct egl *egl) {
 		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
 		EGL_NONE,
 	};
-	EGLConfig egl_config;
-	EGLint context_attribs[] = {
+	static const EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
 		EGL_NONE,
-	}
-	*egl = {&major,&minor,&n,&egl_config,config_attribs,context_attribs};
-};
+	};
+	*egl = (struct egl) {0, 0, 0, NULL, config_attribs, context_attribs};
+}
 
 int main(int argc, char *argv[]) {
+	startup.start_ns = monotonic_ns();
+	bool sdf = false;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	const char *snapshot_path = NULL;
+	const char *default_fonts[] = FONT_FALLBACKS;
+	char metrics_path[sizeof ((struct sockaddr_un *)0)->sun_path] = "";
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	int metrics_fd = -1;
+	const char *font_paths[FONT_MAX_FACES];
+	int nfont_paths = 0;
+	struct recording recording;
+	struct replay replay;
+	replay.realtime = false;
+	int i;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--sdf") == 0) {
+			sdf = true;
+		} else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if(strcmp(argv[i], "--realtime") == 0) {
+			replay.realtime = true;
+		} else if(strcmp(argv[i], "--font") == 0 && i + 1 < argc && nfont_paths < FONT_MAX_FACES) {
+			font_paths[nfont_paths++] = argv[++i];
+		} else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+			snapshot_path = argv[++i];
+		} else if(strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			return read_metrics(argv[i + 1]);
+		} else {
+			fprintf(stderr,"usage: %s [--sdf] [--font file]... [--snapshot file] [--record file | --replay file [--realtime]]\n"
+				"       %s --metrics socket\n",argv[0],argv[0]);
+			return 1;
+		}
+	}
+	/* --font replaces the whole fallback chain */
+	if(nfont_paths == 0) {
+		for(i = 0; i < (int)(sizeof default_fonts / sizeof *default_fonts) && i < FONT_MAX_FACES; i++)
+			font_paths[nfont_paths++] = default_fonts[i];
+	}
+	if(record_path && replay_path) {
+		fprintf(stderr,"--record and --replay cannot be combined\n");
+		return 1;
+	}
+	if(replay_path && open_replay(&replay, replay_path) != 0)
+		return 1;
+	if(record_path && open_recording(&recording, record_path) != 0)
+		return 1;
+	/* the shell goes first and reads its startup files while we come up; it
+	 * is told its size once the first window has one */
+	struct pty shell_pty = { .master_fd = -1, .slave_fd = -1 };
+	if(!replay_path)
+		setup_new_tty(&shell_pty);
+	startup_mark(STARTUP_SHELL);
 	struct display display;
 	display_connect(&display);
 	wl_list_init(&display.seats);
+	/* ask for the globals, then load fonts while the compositor answers */
 	struct wl_registry *registry = wl_display_get_registry(display.wl_display);
-	if(wl_initialize_compositor(registry,&display) > 0) {
+	wl_registry_add_listener(registry, &registry_listener, &display);
+	wl_display_flush(display.wl_display);
+	struct glyph glyphs[128];
+	struct freetype_data ft_data;
+	struct opengl_data gl_data;
+	struct texture_data texture_data;
+	texture_data.sdf = sdf;
+	gl_data.texture = 0;
+	display.gl_data = &gl_data;
+	display.texture_data = &texture_data;
+	display.glyphs = &glyphs;
+	memset(glyphs, 0, sizeof glyphs);
+	if(init_fonts(&ft_data, &texture_data, &display.fonts, font_paths, nfont_paths) != 0) {
+		display_disconnect(&display);
+		return 1;
+	}
+	if(pipe2(display.atlas_builder.notify_fd, O_CLOEXEC) < 0) {
+		fprintf(stderr,"failed to create atlas rebuild pipe\n");
+		return 1;
+	}
+	/* the ascii atlas is rasterized on the worker while wayland and egl come
+	 * up; everything else is rasterized by the glyph cache when first drawn */
+	display.atlas_builder.font_path = display.fonts.faces[0].path;
+	start_atlas_build(&display, FONT_PIXEL_SIZE);
+	startup_mark(STARTUP_FONTS);
+	if(wl_initialize_compositor(&display) > 0) {
 		fprintf(stderr,"error initializing compositor\n");
 	}
+	startup_mark(STARTUP_GLOBALS);
 	struct egl egl;
 	init_egl_struct(&egl);
-	wl_initialize_egl(&display,&egl);
-	wl_init_surface(&display);
-	wl_surface_commit(display.wl_surface);
-	wl_display_roundtrip(display.wl_display);
-	if(more_egl_init(&display,&egl) > 0) {
+	if(wl_initialize_egl(&display,&egl) > 0) {
+		display_disconnect(&display);
 		return 1;
 	}
-	struct glyph glyphs[128];
-	struct freetype_data ft_data;
-	struct opengl_data gl_data;
-	struct texture_data texture_data;
-	init_gl_stuff(&ft_data, &gl_data, &texture_data);
-	create_texture(&ft_data, &gl_data, &texture_data, glyphs);
-	/* declare grid of pointers to glyph
-	 * pass it to render_cells
-	 * render cells iterates over it and draws as long as there's glyphs
-	 * also needs to be in callback */
-	char terminal_cells[25][80];
-	init_terminal_cells(terminal_cells);
-	/* struct render_data callback = {&texture_data,glyphs,&gl_data,terminal_cells}; */
-	struct render_data callback;
-	callback.texture_data = &texture_data;
-	callback.glyphs = &glyphs;
-	callback.gl_data = &gl_data;
-	callback.terminal_cells = &terminal_cells;
-	callback.display = &display;
-	callback.term_x = 0;
-	callback.term_y = 0;
-	struct pty pty = {0,0};
-	setup_new_tty(&pty,&display);
-	struct pollfd fds[2];
-	/* get wayland fd */
-	fds[0].fd = wl_display_get_fd(display.wl_display);
-	fds[0].events = POLLIN|POLLPRI;
-	fds[0].revents = 0;
-	fds[1].fd = pty.master_fd;
-	fds[1].events = POLLIN|POLLPRI;
-	fds[1].revents = 0;
-	render_cells(&callback);
+	startup_mark(STARTUP_EGL);
+	/* the first window's surface makes the shared context current, which the
+	 * program and atlas need; later windows only add a surface and a ring */
+	struct session *first = session_create(&display);
+	if(first == NULL) {
+		return 1;
+	}
+	startup_mark(STARTUP_SURFACE);
+	if(init_gl_stuff(&gl_data) != 0) {
+		display_disconnect(&display);
+		return 1;
+	}
+	startup_mark(STARTUP_SHADER);
+	/* waits for the worker, which has usually finished by now */
+	finish_atlas_build(&display);
+	if(gl_data.texture == 0) {
+		fprintf(stderr,"failed to build the glyph atlas\n");
+		display_disconnect(&display);
+		return 1;
+	}
+	startup_mark(STARTUP_ATLAS);
+	if(runtime_dir && snprintf(metrics_path, sizeof metrics_path, "%s/" METRICS_SOCKET "-%d",
+			runtime_dir, (int)getpid()) < (int)sizeof metrics_path)
+		metrics_fd = open_metrics_socket(metrics_path);
+	if(metrics_fd >= 0)
+		printf("metrics on %s\n", metrics_path);
+	first->render_data.recording = record_path ? &recording : NULL;
+	/* a replay starts from an empty screen, so it is never snapshotted */
+	if(snapshot_path && !replay_path)
+		open_snapshot(first, snapshot_path);
+	/* a replay drives the parser from the recording instead of a shell */
+	first->pty = shell_pty;
+	session_start(first, false);
+	if(replay_path)
+		startup_report();
+	struct session *replay_session = replay_path ? first : NULL;
+	if(replay_path)
+		replay.start_ns = monotonic_ns();
 	while(running) {
-		int r = poll(fds, 2, 500);
+		/* fds[0] is wayland, fds[1] the atlas worker, fds[2] the metrics
+		 * socket, the rest one pty each */
+		struct pollfd fds[3 + MAX_SESSIONS];
+		struct session *polled[MAX_SESSIONS];
+		struct session *session, *tmp;
+		int nfds = 3;
+		int timeout = -1;
+		fds[0].fd = wl_display_get_fd(display.wl_display);
+		fds[0].events = POLLIN|POLLPRI;
+		fds[0].revents = 0;
+		fds[1].fd = display.atlas_builder.notify_fd[0];
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		fds[2].fd = metrics_fd;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
+		wl_list_for_each(session, &display.sessions, link) {
+			int sync_wait = synchronized_update_timeout(&session->render_data);
+			if(sync_wait >= 0 && (timeout < 0 || sync_wait < timeout))
+				timeout = sync_wait;
+			/* only the focused window's search is kept current; history
+			 * still being searched keeps the loop scanning between polls */
+			if(session == display.keyboard_focus && search_scan(session))
+				timeout = 0;
+			int snapshot_wait = snapshot_timeout(session);
+			if(snapshot_wait == 0)
+				write_snapshot(session);
+			else if(snapshot_wait > 0 && (timeout < 0 || snapshot_wait < timeout))
+				timeout = snapshot_wait;
+			if(session->pty.master_fd < 0)
+				continue;
+			polled[nfds - 3] = session;
+			fds[nfds].fd = session->pty.master_fd;
+			fds[nfds].events = POLLIN|POLLPRI;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		if(replay_session) {
+			int replay_wait = replay_timeout(&replay);
+			if(replay_wait >= 0 && (timeout < 0 || replay_wait < timeout))
+				timeout = replay_wait;
+		}
+		int r = poll(fds, nfds, timeout < 0 ? 500 : timeout);
+		if(r < 0) {
+			fprintf(stderr,"OH MY GOD!!!!!!!");
+			return 1;
+		}
+		count_metric(&metrics.wakeups, 1);
 		if(fds[0].revents & POLLIN) {
 			if(wl_display_dispatch(display.wl_display) == -1)
 				running = false;
@@ -1010,16 +5492,60 @@ int main(int argc, char *argv[]) {
 			fprintf(stderr,"pollhup in wldisplay fd");
 			wl_display_dispatch(display.wl_display);
 		}
+		if(display.new_session_pending) {
+			display.new_session_pending = false;
+			struct session *new_session = session_create(&display);
+			if(new_session)
+				session_start(new_session, true);
+		}
 		if(fds[1].revents & POLLIN) {
-			read_shell_input(fds[1].fd, &callback);
+			finish_atlas_build(&display);
 		}
-		if(fds[1].revents & POLLHUP) {
-			fprintf(stderr,"pollhup in wldisplay fd");
+		if(fds[2].revents & POLLIN) {
+			serve_metrics(metrics_fd, &display);
 		}
-		if(r < 0) {
-			fprintf(stderr,"OH MY GOD!!!!!!!");
-			return 1;
+		for(i = 3; i < nfds; i++) {
+			session = polled[i - 3];
+			/* the shell exited: its window goes with it */
+			if(fds[i].revents & POLLIN) {
+				if(read_shell_input(fds[i].fd, &session->render_data) < 0)
+					session->closed = true;
+			} else if(fds[i].revents & POLLHUP) {
+				session->closed = true;
+			}
 		}
+		if(!startup.reported && startup.phase_ns[STARTUP_FIRST_PROMPT])
+			startup_report();
+		if(replay_session) {
+			replay_step(&replay_session->render_data, &replay);
+		}
+		wl_list_for_each(session, &display.sessions, link) {
+			if(synchronized_update_timeout(&session->render_data) == 0) {
+				fprintf(stderr,"synchronized update timed out\n");
+				end_synchronized_update(&session->render_data);
+			}
+		}
+		/* sessions are only destroyed here, never under a callback */
+		wl_list_for_each_safe(session, tmp, &display.sessions, link) {
+			if(!session->closed)
+				continue;
+			if(session == replay_session) {
+				replay_session = NULL;
+				running = false;
+			}
+			session_destroy(session);
+		}
+		/* reap shells that exited after their windows closed */
+		while(waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		if(wl_list_empty(&display.sessions))
+			running = false;
+	}
+	if(record_path)
+		close_recording(&recording);
+	if(metrics_fd >= 0) {
+		close(metrics_fd);
+		unlink(metrics_path);
 	}
 	display_disconnect(&display);
 	return 0;